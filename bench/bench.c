@@ -0,0 +1,93 @@
+/*
+ * japlay benchmarks
+ * Copyright Janne Kulmala 2010
+ *
+ * Measures the audio paths that run for every sample and checks the
+ * optimized versions against the plain ones. Run "make bench", or give
+ * the names of the benchmarks to run on the command line.
+ */
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "../common.h"
+#include "../settings.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+int japlay_debug = 0;
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} benchmarks[] = {
+	{"buffer", bench_buffer},
+	{"sample", bench_sample},
+	{"resample", bench_resample},
+	{"eq", bench_eq},
+};
+
+/* The plugins read their settings, the defaults are used */
+const char *get_setting(const char *name)
+{
+	UNUSED(name);
+	return NULL;
+}
+
+int get_setting_int(const char *name, int defval)
+{
+	UNUSED(name);
+	return defval;
+}
+
+double bench_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+unsigned long long bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return bench_time() * 1e9;
+#endif
+}
+
+void bench_noise(fsample_t *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (int) (seed >> 8 & 0xffff) / 32768.0f - 1;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int i;
+	int failed = 0, j;
+
+	for (i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i) {
+		bool selected = argc < 2;
+		for (j = 1; j < argc; ++j) {
+			if (strcmp(argv[j], benchmarks[i].name) == 0)
+				selected = true;
+		}
+		if (!selected)
+			continue;
+		printf("== %s\n", benchmarks[i].name);
+		failed += benchmarks[i].run();
+	}
+	if (failed) {
+		printf("%d checks failed\n", failed);
+		return 1;
+	}
+	return 0;
+}
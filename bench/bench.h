@@ -0,0 +1,22 @@
+#ifndef _JAPLAY_BENCH_H_
+#define _JAPLAY_BENCH_H_
+
+#include <string.h> /* size_t */
+#include "../plugin.h"
+
+/* Seconds from a monotonic clock */
+double bench_time(void);
+
+/* CPU cycles on x86, nanoseconds elsewhere */
+unsigned long long bench_cycles(void);
+
+/* Repeatable noise between -1.0 and 1.0 */
+void bench_noise(fsample_t *buf, size_t len, unsigned int seed);
+
+/* Each returns the number of failed checks */
+int bench_buffer(void);
+int bench_sample(void);
+int bench_resample(void);
+int bench_eq(void);
+
+#endif
@@ -0,0 +1,428 @@
+/*
+ * japlay benchmarks: audio ring buffer
+ * Copyright Janne Kulmala 2010
+ *
+ * A writer and a reader thread pass a counting sequence through the
+ * lock-free ring, in both the mirrored and the wrapping mode, and through
+ * the ring of the earlier versions, which was protected by the play
+ * mutex. Each ring is used with the locking and sleeping of its version.
+ * The reader checks every sample and the position of every event.
+ */
+#define _GNU_SOURCE
+
+#include "bench.h"
+#include "../buffer.h"
+#include "../common.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define TOTAL		(1 << 25) /* samples passed per run */
+#define MAX_CHUNK	4096
+#define EVENT_EVERY	50000 /* samples between events, about */
+
+/* One implementation of the ring under test */
+struct ring_ops {
+	const char *name;
+	bool events;
+	/* wait until at least MIN_FILL samples can be written */
+	size_t (*write_avail)(void);
+	fsample_t *(*write_ptr)(void);
+	void (*written)(size_t len);
+	void (*write_done)(void);
+	void (*push_event)(unsigned int position);
+	/* wait until there are samples or an event */
+	size_t (*read_avail)(void);
+	const fsample_t *(*read_ptr)(void);
+	void (*processed)(size_t len);
+	/* returns true and the position if an event is due */
+	bool (*get_event)(unsigned int *position);
+};
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t write_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t read_cond = PTHREAD_COND_INITIALIZER;
+static unsigned int sleeps;
+
+/* The lock-free ring, with the sleeping of the player threads: the lock
+   is only taken to sleep or to wake a sleeping thread */
+static struct audio_buffer ring;
+static bool writer_sleeping, reader_sleeping;
+
+static void sleep_thread(pthread_cond_t *cond, bool *sleeping,
+			 bool (*ready)(void))
+{
+	pthread_mutex_lock(&mutex);
+	atomic_write(sleeping, true);
+	memory_barrier();
+	if (!ready()) {
+		pthread_cond_wait(cond, &mutex);
+		sleeps++;
+	}
+	atomic_write(sleeping, false);
+	pthread_mutex_unlock(&mutex);
+}
+
+static void wake_thread(pthread_cond_t *cond, bool *sleeping)
+{
+	memory_barrier();
+	if (atomic_read(sleeping)) {
+		pthread_mutex_lock(&mutex);
+		pthread_cond_signal(cond);
+		pthread_mutex_unlock(&mutex);
+	}
+}
+
+static bool ring_write_ready(void)
+{
+	return buffer_write_avail(&ring, MIN_FILL) >= MIN_FILL;
+}
+
+static size_t ring_write_avail(void)
+{
+	for (;;) {
+		size_t avail = buffer_write_avail(&ring, MIN_FILL);
+		if (avail >= MIN_FILL)
+			return avail;
+		sleep_thread(&write_cond, &writer_sleeping, ring_write_ready);
+	}
+}
+
+static fsample_t *ring_write_ptr(void)
+{
+	return write_buffer(&ring);
+}
+
+static void ring_written(size_t len)
+{
+	buffer_written(&ring, len);
+	wake_thread(&read_cond, &reader_sleeping);
+}
+
+static void ring_write_done(void)
+{
+}
+
+static void ring_push_event(unsigned int position)
+{
+	struct buffer_event event = {.type = EVENT_SEEK,
+				     .position = position};
+	push_buffer_event(&ring, &event);
+}
+
+static bool ring_read_ready(void)
+{
+	return buffer_read_avail(&ring) || get_buffer_event(&ring);
+}
+
+static size_t ring_read_avail(void)
+{
+	for (;;) {
+		size_t avail = buffer_read_avail(&ring);
+		if (avail || get_buffer_event(&ring))
+			return avail;
+		sleep_thread(&read_cond, &reader_sleeping, ring_read_ready);
+	}
+}
+
+static const fsample_t *ring_read_ptr(void)
+{
+	return read_buffer(&ring);
+}
+
+static void ring_processed(size_t len)
+{
+	buffer_processed(&ring, len);
+	wake_thread(&write_cond, &writer_sleeping);
+}
+
+static bool ring_get_event(unsigned int *position)
+{
+	struct buffer_event *event = get_buffer_event(&ring);
+	if (event == NULL)
+		return false;
+	*position = event->position;
+	buffer_event_done(&ring);
+	wake_thread(&write_cond, &writer_sleeping);
+	return true;
+}
+
+/* The ring of the earlier versions. Both threads took the play mutex
+   for every call, the writer slept until the buffer had room and woke
+   the reader only when the buffer was full. */
+static struct {
+	size_t head, tail, wrap;
+	fsample_t *data;
+} old;
+
+static size_t old_buffer_read_avail(void)
+{
+	/* check for wrap around */
+	if (old.tail >= old.wrap) {
+		old.tail = 0;
+		old.wrap = (size_t) -1;
+	}
+
+	size_t end = old.wrap;
+	if (old.head < end && old.head >= old.tail)
+		end = old.head;
+
+	return end - old.tail;
+}
+
+static size_t old_buffer_write_avail(size_t min_avail)
+{
+	if (old.head < old.tail)
+		return old.tail - old.head - 1;
+
+	size_t avail = BUFFER_LEN - old.head;
+	if (avail < min_avail && old.tail != 0) {
+		/* buffer wraps around */
+		if (old.head == old.tail)
+			avail = BUFFER_LEN;
+		else
+			avail = old.tail - 1;
+		old.wrap = old.head;
+		old.head = 0;
+	}
+	return avail;
+}
+
+static size_t old_write_avail(void)
+{
+	for (;;) {
+		pthread_mutex_lock(&mutex);
+		size_t avail = old_buffer_write_avail(MIN_FILL);
+		if (avail < MIN_FILL) {
+			/* buffer is full, wake up play thread and sleep */
+			pthread_cond_signal(&read_cond);
+			pthread_cond_wait(&write_cond, &mutex);
+			sleeps++;
+			pthread_mutex_unlock(&mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&mutex);
+		return avail;
+	}
+}
+
+static fsample_t *old_write_ptr(void)
+{
+	return &old.data[old.head];
+}
+
+static void old_written(size_t len)
+{
+	pthread_mutex_lock(&mutex);
+	old.head += len;
+	pthread_mutex_unlock(&mutex);
+}
+
+/* the player woke the play thread when it quit */
+static void old_write_done(void)
+{
+	pthread_mutex_lock(&mutex);
+	pthread_cond_signal(&read_cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+static size_t old_read_avail(void)
+{
+	for (;;) {
+		pthread_mutex_lock(&mutex);
+		size_t avail = old_buffer_read_avail();
+		if (avail == 0) {
+			/* buffer is empty, sleep */
+			pthread_cond_wait(&read_cond, &mutex);
+			sleeps++;
+			pthread_mutex_unlock(&mutex);
+			continue;
+		}
+		pthread_mutex_unlock(&mutex);
+		return avail;
+	}
+}
+
+static const fsample_t *old_read_ptr(void)
+{
+	return &old.data[old.tail];
+}
+
+static void old_processed(size_t len)
+{
+	pthread_mutex_lock(&mutex);
+	old.tail += len;
+	pthread_cond_signal(&write_cond);
+	pthread_mutex_unlock(&mutex);
+}
+
+static const struct ring_ops lockfree_ops = {
+	.name = "lock-free",
+	.events = true,
+	.write_avail = ring_write_avail,
+	.write_ptr = ring_write_ptr,
+	.written = ring_written,
+	.write_done = ring_write_done,
+	.push_event = ring_push_event,
+	.read_avail = ring_read_avail,
+	.read_ptr = ring_read_ptr,
+	.processed = ring_processed,
+	.get_event = ring_get_event,
+};
+
+static const struct ring_ops old_ops = {
+	.name = "mutex",
+	.events = false,
+	.write_avail = old_write_avail,
+	.write_ptr = old_write_ptr,
+	.written = old_written,
+	.write_done = old_write_done,
+	.read_avail = old_read_avail,
+	.read_ptr = old_read_ptr,
+	.processed = old_processed,
+};
+
+static const struct ring_ops *ops;
+static int cpus;
+
+/* exact in a float */
+static fsample_t sequence(size_t n)
+{
+	return n & 0xffffff;
+}
+
+/* The threads run on different cores when there are several, so that
+   the rings are used concurrently */
+static void set_cpu(int cpu)
+{
+	cpu_set_t set;
+	if (cpus < 2)
+		return;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static void *writer_routine(void *arg)
+{
+	unsigned int seed = 1;
+	size_t n = 0, next_event = EVENT_EVERY;
+	UNUSED(arg);
+
+	set_cpu(1);
+	while (n < TOTAL) {
+		if (ops->events && n >= next_event) {
+			ops->push_event(n);
+			next_event = n + EVENT_EVERY / 2 +
+				rand_r(&seed) % EVENT_EVERY;
+		}
+		size_t len = ops->write_avail();
+		size_t chunk = 1 + rand_r(&seed) % MAX_CHUNK;
+		if (len > chunk)
+			len = chunk;
+		if (len > TOTAL - n)
+			len = TOTAL - n;
+		fsample_t *dst = ops->write_ptr();
+		size_t i;
+		for (i = 0; i < len; ++i)
+			dst[i] = sequence(n + i);
+		ops->written(len);
+		n += len;
+	}
+	ops->write_done();
+	return NULL;
+}
+
+/* Returns the number of errors found */
+static size_t read_all(void)
+{
+	unsigned int seed = 2;
+	size_t n = 0, errors = 0, events = 0;
+
+	set_cpu(0);
+	while (n < TOTAL) {
+		unsigned int position;
+		if (ops->events && ops->get_event(&position)) {
+			if (position != (unsigned int) n)
+				errors++;
+			events++;
+			continue;
+		}
+		size_t len = ops->read_avail();
+		if (len == 0)
+			continue; /* an event */
+		size_t chunk = 1 + rand_r(&seed) % MAX_CHUNK;
+		if (len > chunk)
+			len = chunk;
+		const fsample_t *src = ops->read_ptr();
+		size_t i;
+		for (i = 0; i < len; ++i) {
+			if (src[i] != sequence(n + i))
+				errors++;
+		}
+		ops->processed(len);
+		n += len;
+	}
+	if (ops->events && events < TOTAL / EVENT_EVERY / 2)
+		errors++;
+	return errors;
+}
+
+static int run(const struct ring_ops *o, const char *mode)
+{
+	pthread_t writer;
+	ops = o;
+	sleeps = 0;
+	double start = bench_time();
+	if (pthread_create(&writer, NULL, writer_routine, NULL)) {
+		printf("unable to start the writer thread\n");
+		return 1;
+	}
+	size_t errors = read_all();
+	pthread_join(writer, NULL);
+	double secs = bench_time() - start;
+
+	printf("%-10s %-9s %7.1f Msamples/s  %7u sleeps  %s\n", o->name,
+	       mode, TOTAL / secs / 1e6, sleeps, errors ? "FAILED" : "ok");
+	if (errors)
+		printf("  %zu wrong samples or events\n", errors);
+	return errors != 0;
+}
+
+int bench_buffer(void)
+{
+	int failed = 0;
+	cpu_set_t set;
+
+	cpus = 1;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		cpus = CPU_COUNT(&set);
+	if (cpus < 2)
+		printf("one CPU, the threads take turns and do not contend\n");
+	else
+		printf("writer and reader on separate CPUs\n");
+
+	if (init_buffer(&ring))
+		return 1;
+	failed += run(&lockfree_ops, ring.mirrored ? "mirrored" : "wrapping");
+
+	/* the fallback when the ring can not be mapped twice */
+	memset(&ring, 0, sizeof(ring));
+	ring.wrap = (size_t) -1;
+	ring.limit = BUFFER_LEN;
+	ring.data = malloc(BUFFER_LEN * sizeof(fsample_t));
+	if (ring.data == NULL)
+		return failed + 1;
+	failed += run(&lockfree_ops, "wrapping");
+	free(ring.data);
+
+	old.wrap = (size_t) -1;
+	old.data = malloc(BUFFER_LEN * sizeof(fsample_t));
+	if (old.data == NULL)
+		return failed + 1;
+	failed += run(&old_ops, "");
+	free(old.data);
+	return failed;
+}
@@ -0,0 +1,87 @@
+/*
+ * japlay benchmarks: parametric equalizer
+ * Copyright Janne Kulmala 2010
+ *
+ * Built together with dsp_eq.c to reach the versions that are not
+ * selected on this CPU.
+ */
+#include "../dsp_eq.c"
+#include "bench.h"
+
+#define SECONDS		10
+#define RATE		96000 /* the budget is ten bands at 96 kHz */
+#define MAX_LEN		(RATE * 6 * SECONDS)
+#define CHUNK		0x1000 /* samples per call */
+
+static const char *bands[] = {
+	"lowshelf 80 4", "peak 120 -2 1.4", "peak 250 1.5", "peak 500 -3 2",
+	"peak 1000 2", "peak 2000 -1.5 0.7", "peak 4000 3 1.2",
+	"peak 8000 -2", "peak 12000 1", "highshelf 10000 -3",
+};
+
+static const char *simd_names[] = {
+	[SIMD_NONE] = "c",
+	[SIMD_SSE2] = "sse2",
+	[SIMD_AVX] = "avx",
+};
+
+static fsample_t input[MAX_LEN], ref[MAX_LEN], output[MAX_LEN];
+static struct dsp_plugin_ctx ctx;
+
+static double run(unsigned int channels, enum simd_level simd, fsample_t *buf)
+{
+	struct input_format format = {.rate = RATE, .channels = channels};
+	size_t len = RATE * channels * SECONDS, pos, i;
+
+	eq_configure(&ctx, &format);
+	ctx.simd = simd;
+	ctx.bands = 0;
+	for (i = 0; i < sizeof(bands) / sizeof(bands[0]); ++i) {
+		if (parse_band(&ctx.band[ctx.bands], bands[i], RATE))
+			ctx.bands++;
+	}
+
+	memcpy(buf, input, len * sizeof(fsample_t));
+	double start = bench_time();
+	for (pos = 0; pos < len; pos += CHUNK)
+		eq_process(&ctx, &buf[pos], len - pos < CHUNK ? len - pos : CHUNK);
+	return bench_time() - start;
+}
+
+static int check(unsigned int channels, enum simd_level simd)
+{
+	size_t len = RATE * channels * SECONDS;
+	double secs = run(channels, simd, output);
+	/* the same double precision operations in every version */
+	bool ok = memcmp(output, ref, len * sizeof(fsample_t)) == 0;
+	printf("%u ch  %-5s %7.1f Msamples/s  %5.2f%% of a core  %s\n",
+	       channels, simd_names[simd], len / secs / 1e6,
+	       100.0 * secs / SECONDS, ok ? "ok" : "FAILED");
+	return !ok;
+}
+
+int bench_eq(void)
+{
+	static const unsigned int layouts[] = {1, 2, 6};
+	int failed = 0;
+	unsigned int i;
+
+	bench_noise(input, MAX_LEN, 4);
+	printf("%u bands at %u Hz\n", (unsigned int) (sizeof(bands) /
+						      sizeof(bands[0])), RATE);
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+#endif
+	for (i = 0; i < sizeof(layouts) / sizeof(layouts[0]); ++i) {
+		unsigned int channels = layouts[i];
+		run(channels, SIMD_NONE, ref);
+		failed += check(channels, SIMD_NONE);
+#ifdef HAVE_X86
+		if (__builtin_cpu_supports("sse2"))
+			failed += check(channels, SIMD_SSE2);
+		if (__builtin_cpu_supports("avx"))
+			failed += check(channels, SIMD_AVX);
+#endif
+	}
+	return failed;
+}
@@ -0,0 +1,104 @@
+/*
+ * japlay benchmarks: resampler
+ * Copyright Janne Kulmala 2010
+ *
+ * Built together with resample.c to reach the versions that are not
+ * selected on this CPU.
+ */
+#include "../resample.c"
+#include "bench.h"
+#include <stdio.h>
+
+#define SECONDS		10
+#define IN_RATE		44100
+#define OUT_RATE	48000
+#define CHANNELS	2
+#define IN_LEN		(IN_RATE * CHANNELS * SECONDS)
+#define OUT_LEN		(OUT_RATE * CHANNELS * SECONDS + 0x1000)
+#define CHUNK		0x1000 /* input samples per call */
+
+typedef float (*dot_func_t)(const float *, const float *, unsigned int);
+
+static const char *quality_names[] = {
+	[RESAMPLE_FAST] = "fast",
+	[RESAMPLE_MEDIUM] = "medium",
+	[RESAMPLE_BEST] = "best",
+};
+
+static fsample_t input[IN_LEN];
+static fsample_t ref[OUT_LEN], output[OUT_LEN];
+static struct resampler rs;
+
+/* Returns the number of output samples */
+static size_t run(enum resample_quality quality, fsample_t *out,
+		  double *secs)
+{
+	struct input_format in = {.rate = IN_RATE, .channels = CHANNELS};
+	struct input_format to = {.rate = OUT_RATE, .channels = CHANNELS};
+	size_t pos = 0, len = 0;
+
+	if (setup_resampler(&rs, &in, &to, quality))
+		return 0;
+	double start = bench_time();
+	while (pos < IN_LEN && len < OUT_LEN) {
+		size_t inlen = IN_LEN - pos < CHUNK ? IN_LEN - pos : CHUNK;
+		len += resample(&rs, &out[len], OUT_LEN - len, &input[pos],
+				&inlen);
+		pos += inlen;
+	}
+	*secs = bench_time() - start;
+	free(rs.coeffs);
+	rs.coeffs = NULL;
+	return len;
+}
+
+static int check(enum resample_quality quality, const char *impl,
+		 dot_func_t f, size_t ref_len)
+{
+	double secs;
+	dot_func = f;
+	size_t len = run(quality, output, &secs);
+
+	float err = 0;
+	size_t i;
+	for (i = 0; i < len && i < ref_len; ++i) {
+		if (fabsf(output[i] - ref[i]) > err)
+			err = fabsf(output[i] - ref[i]);
+	}
+	/* only the summation order differs */
+	bool ok = len == ref_len && err < 1e-5f;
+	printf("%-7s %-5s %7.1f Msamples/s  %5.2f%% of a core  %s\n",
+	       quality_names[quality], impl, len / secs / 1e6,
+	       100.0 * secs / SECONDS, ok ? "ok" : "FAILED");
+	return !ok;
+}
+
+int bench_resample(void)
+{
+	int failed = 0;
+	enum resample_quality q;
+
+	bench_noise(input, IN_LEN, 3);
+	printf("%u Hz to %u Hz, %u channels\n", IN_RATE, OUT_RATE, CHANNELS);
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+#endif
+	for (q = RESAMPLE_FAST; q <= RESAMPLE_BEST; ++q) {
+		double secs;
+		dot_func = dot_c;
+		size_t ref_len = run(q, ref, &secs);
+		if (ref_len == 0) {
+			printf("%s: unable to set up\n", quality_names[q]);
+			failed++;
+			continue;
+		}
+		failed += check(q, "c", dot_c, ref_len);
+#ifdef HAVE_X86
+		if (__builtin_cpu_supports("sse2"))
+			failed += check(q, "sse2", dot_sse2, ref_len);
+		if (__builtin_cpu_supports("avx"))
+			failed += check(q, "avx", dot_avx, ref_len);
+#endif
+	}
+	return failed;
+}
@@ -0,0 +1,154 @@
+/*
+ * japlay benchmarks: sample conversion, crossfade and level meter
+ * Copyright Janne Kulmala 2010
+ *
+ * Built together with sample.c to reach the versions that are not
+ * selected on this CPU.
+ */
+#include "../sample.c"
+#include "bench.h"
+#include <stdlib.h>
+
+#define LEN		4096 /* samples, fits in the L1 cache */
+#define ROUNDS		2000
+
+typedef void (*convert_func)(sample_t *, const fsample_t *, size_t, float);
+typedef void (*fade_func)(fsample_t *, const fsample_t *, size_t,
+			  unsigned int, size_t, size_t);
+typedef void (*measure_func_t)(struct level_meter *, const fsample_t *,
+			       size_t);
+
+static fsample_t src[LEN], mix[LEN], ref_f[LEN], out_f[LEN];
+static sample_t ref_s[LEN], out_s[LEN];
+
+static void report(const char *name, const char *impl,
+		   unsigned long long cycles, bool ok)
+{
+	printf("%-14s %-6s %6.2f cycles/sample  %s\n", name, impl,
+	       (double) cycles / LEN, ok ? "ok" : "FAILED");
+}
+
+/* Fastest of the rounds, the others were disturbed */
+static unsigned long long time_convert(convert_func f)
+{
+	unsigned long long best = -1;
+	int i;
+	for (i = 0; i < ROUNDS; ++i) {
+		unsigned long long start = bench_cycles();
+		f(out_s, src, LEN, 0.8f);
+		unsigned long long t = bench_cycles() - start;
+		if (t < best)
+			best = t;
+	}
+	return best;
+}
+
+static int check_convert(const char *impl, convert_func f)
+{
+	unsigned long long t = time_convert(f);
+	/* the clamp and the truncation are the same in all versions */
+	bool ok = memcmp(out_s, ref_s, sizeof(ref_s)) == 0;
+	report("float_to_s16", impl, t, ok);
+	return !ok;
+}
+
+static int check_fade(const char *impl, fade_func f, unsigned int channels)
+{
+	unsigned long long best = -1;
+	float err = 0;
+	size_t i;
+	int r;
+	for (r = 0; r < ROUNDS; ++r) {
+		memcpy(out_f, mix, sizeof(mix));
+		unsigned long long start = bench_cycles();
+		f(out_f, src, LEN, channels, 1000, 48000);
+		unsigned long long t = bench_cycles() - start;
+		if (t < best)
+			best = t;
+	}
+	for (i = 0; i < LEN; ++i) {
+		if (fabsf(out_f[i] - ref_f[i]) > err)
+			err = fabsf(out_f[i] - ref_f[i]);
+	}
+	char name[16];
+	sprintf(name, "mix_fade %uch", channels);
+	report(name, impl, best, err < 1e-6f);
+	return err >= 1e-6f;
+}
+
+static bool close_enough(double a, double b)
+{
+	return fabs(a - b) <= 1e-5 * fabs(b) + 1e-9;
+}
+
+static int check_measure(const char *impl, measure_func_t f,
+			 unsigned int channels, const struct level_meter *ref)
+{
+	unsigned long long best = -1;
+	struct level_meter meter;
+	int r;
+	for (r = 0; r < ROUNDS; ++r) {
+		reset_meter(&meter, channels);
+		unsigned long long start = bench_cycles();
+		f(&meter, src, LEN / channels);
+		unsigned long long t = bench_cycles() - start;
+		if (t < best)
+			best = t;
+	}
+	bool ok = close_enough(meter.sum[0], ref->sum[0]) &&
+		close_enough(meter.sum[1], ref->sum[1]) &&
+		close_enough(meter.cross, ref->cross) &&
+		meter.peak[0] == ref->peak[0] && meter.peak[1] == ref->peak[1];
+	char name[16];
+	sprintf(name, "measure %uch", channels);
+	report(name, impl, best, ok);
+	return !ok;
+}
+
+int bench_sample(void)
+{
+	int failed = 0;
+	unsigned int channels;
+	size_t i;
+
+	/* some samples clip */
+	bench_noise(src, LEN, 1);
+	for (i = 0; i < LEN; i += 37)
+		src[i] *= 1.5f;
+	bench_noise(mix, LEN, 2);
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+#endif
+	float_to_s16_c(ref_s, src, LEN, 0.8f);
+	failed += check_convert("c", float_to_s16_c);
+#ifdef HAVE_X86
+	if (__builtin_cpu_supports("sse2"))
+		failed += check_convert("sse2", float_to_s16_sse2);
+	if (__builtin_cpu_supports("avx2"))
+		failed += check_convert("avx2", float_to_s16_avx2);
+#endif
+
+	for (channels = 1; channels <= 2; ++channels) {
+		memcpy(ref_f, mix, sizeof(mix));
+		mix_fade_c(ref_f, src, LEN, channels, 1000, 48000);
+		failed += check_fade("c", mix_fade_c, channels);
+#ifdef HAVE_X86
+		if (__builtin_cpu_supports("sse2"))
+			failed += check_fade("sse2", mix_fade_sse2, channels);
+#endif
+	}
+
+	for (channels = 1; channels <= 2; ++channels) {
+		struct level_meter ref;
+		reset_meter(&ref, channels);
+		measure_c(&ref, src, LEN / channels);
+		failed += check_measure("c", measure_c, channels, &ref);
+#ifdef HAVE_X86
+		if (__builtin_cpu_supports("sse2"))
+			failed += check_measure("sse2", measure_sse2, channels,
+						&ref);
+#endif
+	}
+	return failed;
+}
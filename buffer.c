@@ -1,77 +1,254 @@
+#define _GNU_SOURCE /* memfd_create */
+
 #include "buffer.h"
 #include "common.h"
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/*
+ * Lock-free single producer, single consumer ring buffer. The decode
+ * thread owns "head", "wrap", "written" and "event_head", the play thread
+ * owns "tail", "processed" and "event_tail". Each side publishes its own
+ * index with a release store and reads the other side's index with an
+ * acquire load.
+ *
+ * If possible, the ring is mapped twice back to back in virtual memory.
+ * Reads and writes can then run over the end of the ring and are always
+ * contiguous, and the positions are simply the sample counts modulo the
+ * length. Otherwise the writer wraps around early when there is not
+ * enough room left at the end.
+ */
+
+#define EVENT_RESERVE	4 /* events added by a single decode round */
+
+#define BUFFER_SIZE	(BUFFER_LEN * sizeof(fsample_t))
+
+static fsample_t *map_mirrored(void)
+{
+#ifdef MFD_CLOEXEC
+	int fd = memfd_create("japlay-buffer", MFD_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (ftruncate(fd, BUFFER_SIZE)) {
+		close(fd);
+		return NULL;
+	}
+
+	/* reserve address space for two copies */
+	char *addr = mmap(NULL, 2 * BUFFER_SIZE, PROT_NONE,
+			  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if (mmap(addr, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(addr + BUFFER_SIZE, BUFFER_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(addr, 2 * BUFFER_SIZE);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	return (fsample_t *) addr;
+#else
+	return NULL;
+#endif
+}
 
-void init_buffer(struct audio_buffer *buf)
+int init_buffer(struct audio_buffer *buf)
 {
 	memset(buf, 0, sizeof(*buf));
-	buf->event = (size_t) -1;
 	buf->wrap = (size_t) -1;
+	buf->limit = BUFFER_LEN;
+
+	buf->data = map_mirrored();
+	if (buf->data) {
+		buf->mirrored = true;
+		return 0;
+	}
+	warning("unable to map a mirrored audio buffer\n");
+	buf->data = malloc(BUFFER_SIZE);
+	if (buf->data == NULL)
+		return -1;
+	return 0;
 }
 
-bool check_buffer_event(struct audio_buffer *buf)
+/* Keep the ring in memory, so the play thread never waits for a page
+   fault. Call before the threads are started. */
+int lock_buffer(struct audio_buffer *buf)
 {
-	return (buf->tail == buf->event);
+	/* both views of a mirrored ring need their page tables set up */
+	size_t size = buf->mirrored ? 2 * BUFFER_SIZE : BUFFER_SIZE;
+	int ret = mlock(buf->data, size);
+
+	/* touch every page, in case mlock failed */
+	memset(buf->data, 0, BUFFER_SIZE);
+	if (buf->mirrored)
+		memset((char *) buf->data + BUFFER_SIZE, 0, BUFFER_SIZE);
+	return ret;
 }
 
 size_t buffer_read_avail(struct audio_buffer *buf)
 {
-	/* check for wrap around */
-	if (buf->tail >= buf->wrap) {
-		buf->tail = 0;
-		buf->wrap = (size_t) -1;
+	size_t avail;
+
+	if (buf->mirrored)
+		avail = atomic_read(&buf->written) - buf->processed;
+	else {
+		size_t head = atomic_read(&buf->head);
+		size_t end = head;
+		if (head < buf->tail) {
+			/* writer has wrapped around, wrap is stable until
+			   we follow */
+			if (buf->tail >= buf->wrap)
+				atomic_write(&buf->tail, 0);
+			else
+				end = buf->wrap;
+		}
+		avail = end - buf->tail;
 	}
 
-	size_t end = buf->wrap;
-	if (buf->head < end && buf->head >= buf->tail)
-		end = buf->head;
-	if (buf->event < end && buf->event >= buf->tail)
-		end = buf->event;
+	/* stop at the next event */
+	if (buf->event_tail != atomic_read(&buf->event_head)) {
+		struct buffer_event *event =
+			&buf->events[buf->event_tail % MAX_EVENTS];
+		if (avail > event->offset - buf->processed)
+			avail = event->offset - buf->processed;
+	}
+	return avail;
+}
 
-	return end - buf->tail;
+/* Returns true if the event queue has room for one decode round */
+bool buffer_event_room(struct audio_buffer *buf)
+{
+	return buf->event_head - atomic_read(&buf->event_tail) <=
+		MAX_EVENTS - EVENT_RESERVE;
 }
 
 int buffer_write_avail(struct audio_buffer *buf, size_t min_avail)
 {
-	if (buf->head < buf->tail)
-		return buf->tail - buf->head - 1;
-
-	size_t avail = BUFFER_LEN - buf->head;
-	if (avail < min_avail && buf->tail != 0) {
-		/* buffer wraps around */
-		if (buf->head == buf->tail)
-			avail = BUFFER_LEN;
-		else
-			avail = buf->tail - 1;
-		buf->wrap = buf->head;
-		buf->head = 0;
+	size_t avail, fill;
+
+	if (!buffer_event_room(buf))
+		return 0;
+
+	if (buf->mirrored) {
+		fill = buf->written - atomic_read(&buf->processed);
+		avail = BUFFER_LEN - fill;
+	} else {
+		size_t tail = atomic_read(&buf->tail);
+		if (buf->head < tail) {
+			avail = tail - buf->head - 1;
+			fill = buf->wrap - tail + buf->head;
+		} else {
+			avail = BUFFER_LEN - buf->head;
+			fill = buf->head - tail;
+			if (avail < min_avail && tail != 0) {
+				/* buffer wraps around. Never catch up the
+				   tail, the reader might not have seen the
+				   previous wrap yet. */
+				buf->wrap = buf->head;
+				atomic_write(&buf->head, 0);
+				avail = tail - 1;
+			}
+		}
 	}
+
+	/* do not buffer more than the limit */
+	if (fill >= buf->limit)
+		return 0;
+	if (avail > buf->limit - fill)
+		avail = buf->limit - fill;
 	return avail;
 }
 
-sample_t *read_buffer(struct audio_buffer *buf)
+/* Samples written but not yet processed, stale ones included. Can be
+   called from either side. */
+size_t buffer_fill(struct audio_buffer *buf)
 {
+	return atomic_read(&buf->written) - atomic_read(&buf->processed);
+}
+
+fsample_t *read_buffer(struct audio_buffer *buf)
+{
+	if (buf->mirrored)
+		return &buf->data[buf->processed % BUFFER_LEN];
 	return &buf->data[buf->tail];
 }
 
-sample_t *write_buffer(struct audio_buffer *buf)
+fsample_t *write_buffer(struct audio_buffer *buf)
 {
+	if (buf->mirrored)
+		return &buf->data[buf->written % BUFFER_LEN];
 	return &buf->data[buf->head];
 }
 
 void buffer_processed(struct audio_buffer *buf, size_t len)
 {
-	if (buf->tail == buf->event)
-		buf->event = (size_t) -1;
-	buf->tail += len;
+	if (!buf->mirrored)
+		atomic_write(&buf->tail, buf->tail + len);
+	atomic_write(&buf->processed, buf->processed + len);
 }
 
 void buffer_written(struct audio_buffer *buf, size_t len)
 {
-	buf->head += len;
+	if (!buf->mirrored)
+		atomic_write(&buf->head, buf->head + len);
+	atomic_write(&buf->written, buf->written + len);
+}
+
+/* Mark all audio written so far as stale. Events are still delivered. */
+void flush_buffer(struct audio_buffer *buf)
+{
+	atomic_write(&buf->flush, buf->written);
+}
+
+/* Returns the number of stale samples at the read position */
+size_t buffer_stale(struct audio_buffer *buf)
+{
+	size_t flush = atomic_read(&buf->flush);
+	if (flush > buf->processed)
+		return flush - buf->processed;
+	return 0;
+}
+
+/* Queue an event to take place before the next written sample */
+int push_buffer_event(struct audio_buffer *buf, struct buffer_event *event)
+{
+	if (buf->event_head - atomic_read(&buf->event_tail) >= MAX_EVENTS) {
+		warning("audio event queue is full\n");
+		return -1;
+	}
+	event->offset = buf->written;
+	buf->events[buf->event_head % MAX_EVENTS] = *event;
+	atomic_write(&buf->event_head, buf->event_head + 1);
+	return 0;
+}
+
+/* Returns the event if it takes place at the current read position */
+struct buffer_event *get_buffer_event(struct audio_buffer *buf)
+{
+	if (buf->event_tail == atomic_read(&buf->event_head))
+		return NULL;
+	struct buffer_event *event = &buf->events[buf->event_tail % MAX_EVENTS];
+	if (event->offset != buf->processed)
+		return NULL;
+	return event;
+}
+
+void buffer_event_done(struct audio_buffer *buf)
+{
+	atomic_write(&buf->event_tail, buf->event_tail + 1);
 }
 
-void mark_buffer_event(struct audio_buffer *buf)
+void set_buffer_limit(struct audio_buffer *buf, size_t limit)
 {
-	buf->event = buf->head;
+	/* must leave room for at least one fillbuf call */
+	if (limit < 2 * MIN_FILL)
+		limit = 2 * MIN_FILL;
+	if (limit > BUFFER_LEN)
+		limit = BUFFER_LEN;
+	buf->limit = limit;
 }
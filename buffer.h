@@ -4,22 +4,53 @@
 #include <string.h> /* size_t */
 #include "plugin.h"
 
-#define BUFFER_LEN		0x8000
+#define BUFFER_LEN		0x40000 /* about 2.7s at 48 kHz, stereo */
+#define MAX_EVENTS		16
+
+struct playlist_entry;
+
+enum buffer_event_type {
+	EVENT_FORMAT,	/* audio format changes */
+	EVENT_SEEK,	/* song position jumps */
+	EVENT_SONG,	/* a new song starts, or the queue runs out */
+};
+
+struct buffer_event {
+	enum buffer_event_type type;
+	size_t offset; /* sample count where the event takes place */
+	struct input_format format;
+	unsigned int position; /* new song position in milliseconds */
+	struct playlist_entry *entry; /* holds a reference */
+};
 
 struct audio_buffer {
-	size_t head, tail, wrap, event;
-	sample_t data[BUFFER_LEN];
+	size_t head, tail, wrap;
+	size_t limit; /* maximum number of buffered samples */
+	size_t written, processed; /* total sample counts */
+	size_t flush; /* samples written before this count are stale */
+	/* side queue of events, keyed by the sample count */
+	unsigned int event_head, event_tail;
+	struct buffer_event events[MAX_EVENTS];
+	bool mirrored; /* data is mapped twice back to back */
+	fsample_t *data;
 };
 
-void init_buffer(struct audio_buffer *buf);
-bool check_buffer_event(struct audio_buffer *buf);
+int init_buffer(struct audio_buffer *buf);
+int lock_buffer(struct audio_buffer *buf);
 size_t buffer_read_avail(struct audio_buffer *buf);
+bool buffer_event_room(struct audio_buffer *buf);
 int buffer_write_avail(struct audio_buffer *buf, size_t min_avail);
-sample_t *read_buffer(struct audio_buffer *buf);
-sample_t *write_buffer(struct audio_buffer *buf);
+size_t buffer_fill(struct audio_buffer *buf);
+fsample_t *read_buffer(struct audio_buffer *buf);
+fsample_t *write_buffer(struct audio_buffer *buf);
 void buffer_processed(struct audio_buffer *buf, size_t len);
 void buffer_written(struct audio_buffer *buf, size_t len);
-void mark_buffer_event(struct audio_buffer *buf);
+void flush_buffer(struct audio_buffer *buf);
+size_t buffer_stale(struct audio_buffer *buf);
+int push_buffer_event(struct audio_buffer *buf, struct buffer_event *event);
+struct buffer_event *get_buffer_event(struct audio_buffer *buf);
+void buffer_event_done(struct audio_buffer *buf);
+void set_buffer_limit(struct audio_buffer *buf, size_t limit);
 
 
 #endif
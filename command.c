@@ -0,0 +1,61 @@
+#include "command.h"
+#include "common.h"
+
+/*
+ * Lock-free multiple producer, single consumer queue of commands. Any
+ * thread can push, only the owning thread pops. Each slot has a sequence
+ * number that tells whose turn it is: it equals the position when the
+ * slot is free to be written, and the position + 1 when it holds a
+ * command. Producers claim a position by advancing "tail" with a
+ * compare-and-swap, the consumer owns "head".
+ */
+
+void init_command_queue(struct command_queue *queue)
+{
+	unsigned int i;
+	queue->head = 0;
+	queue->tail = 0;
+	for (i = 0; i < COMMAND_SLOTS; ++i)
+		queue->slots[i].seq = i;
+}
+
+/* Returns -1 if the queue is full */
+int push_command(struct command_queue *queue, const struct command *cmd)
+{
+	unsigned int pos = atomic_read(&queue->tail);
+	struct command_slot *slot;
+	while (true) {
+		slot = &queue->slots[pos % COMMAND_SLOTS];
+		int diff = (int) (atomic_read(&slot->seq) - pos);
+		if (diff == 0) {
+			if (atomic_cas(&queue->tail, &pos, pos + 1))
+				break;
+			/* another producer took it, pos was reloaded */
+		} else if (diff < 0)
+			return -1;
+		else
+			pos = atomic_read(&queue->tail);
+	}
+	slot->cmd = *cmd;
+	atomic_write(&slot->seq, pos + 1);
+	return 0;
+}
+
+bool pop_command(struct command_queue *queue, struct command *cmd)
+{
+	unsigned int pos = queue->head;
+	struct command_slot *slot = &queue->slots[pos % COMMAND_SLOTS];
+	if (atomic_read(&slot->seq) != pos + 1)
+		return false;
+	*cmd = slot->cmd;
+	atomic_write(&slot->seq, pos + COMMAND_SLOTS);
+	queue->head = pos + 1;
+	return true;
+}
+
+/* Called by the consumer */
+bool command_pending(struct command_queue *queue)
+{
+	unsigned int pos = queue->head;
+	return atomic_read(&queue->slots[pos % COMMAND_SLOTS].seq) == pos + 1;
+}
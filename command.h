@@ -0,0 +1,36 @@
+#ifndef _JAPLAY_COMMAND_H_
+#define _JAPLAY_COMMAND_H_
+
+#include <stdbool.h>
+
+#define COMMAND_SLOTS		64 /* power of two */
+
+enum command_type {
+	CMD_PLAY,
+	CMD_PAUSE,
+	CMD_STOP,	/* value counts the stops and skips sent */
+	CMD_SKIP,	/* as above */
+	CMD_VOLUME,	/* value is 0 .. 256 */
+};
+
+struct command {
+	enum command_type type;
+	long value;
+};
+
+struct command_slot {
+	unsigned int seq;
+	struct command cmd;
+};
+
+struct command_queue {
+	unsigned int head, tail;
+	struct command_slot slots[COMMAND_SLOTS];
+};
+
+void init_command_queue(struct command_queue *queue);
+int push_command(struct command_queue *queue, const struct command *cmd);
+bool pop_command(struct command_queue *queue, struct command *cmd);
+bool command_pending(struct command_queue *queue);
+
+#endif
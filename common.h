@@ -24,6 +24,17 @@
 #define container_of(ptr, type, member) \
 	((type *) ((char *) (ptr) - offsetof(type, member)))
 
+/* Access to variables shared between threads without a lock */
+#define atomic_read(ptr)	__atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define atomic_write(ptr, val)	__atomic_store_n(ptr, val, __ATOMIC_RELEASE)
+#define memory_barrier()	__atomic_thread_fence(__ATOMIC_SEQ_CST)
+/* Stores val if *ptr equals *expected, otherwise loads *ptr to *expected */
+#define atomic_cas(ptr, expected, val) \
+	__atomic_compare_exchange_n(ptr, expected, val, false, \
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+/* Adds val to *ptr, returns the new value */
+#define atomic_add(ptr, val)	__atomic_add_fetch(ptr, val, __ATOMIC_ACQ_REL)
+
 extern int japlay_debug;
 
 #endif
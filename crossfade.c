@@ -0,0 +1,115 @@
+/*
+ * japlay - Just Another Player
+ * Copyright Janne Kulmala 2010
+ */
+#include "crossfade.h"
+#include "sample.h"
+#include "common.h"
+#include <stdlib.h>
+
+/* "chunk" is the largest number of samples written at once */
+int setup_crossfade(struct crossfade *cf, const struct input_format *format,
+		    unsigned int msecs, size_t chunk)
+{
+	size_t fade_len = (size_t) msecs * format->rate / 1000 *
+		format->channels;
+	chunk -= chunk % format->channels;
+	size_t size = fade_len + chunk;
+
+	if (size != cf->size) {
+		fsample_t *data = malloc(size * sizeof(fsample_t));
+		if (data == NULL)
+			return -1;
+		free(cf->data);
+		cf->data = data;
+		cf->size = size;
+	}
+	cf->format = *format;
+	cf->msecs = msecs;
+	cf->fade_len = fade_len;
+	crossfade_flush(cf);
+	return 0;
+}
+
+/* Append samples, mixing them with the held audio if a fade is in
+   progress. Returns the number of samples taken. */
+size_t crossfade_write(struct crossfade *cf, const fsample_t *buf, size_t len)
+{
+	unsigned int channels = cf->format.channels;
+	size_t done = 0;
+
+	while (done < len && cf->fade_done < cf->fade_total) {
+		/* mix in place, at most up to the end of the buffer */
+		size_t pos = (cf->head + cf->final) % cf->size;
+		size_t n = len - done;
+		if (n > cf->fade_total - cf->fade_done)
+			n = cf->fade_total - cf->fade_done;
+		if (n > cf->size - pos)
+			n = cf->size - pos;
+		mix_fade(&cf->data[pos], &buf[done], n, channels,
+			 cf->fade_done / channels, cf->fade_total / channels);
+		cf->fade_done += n;
+		cf->final += n;
+		done += n;
+	}
+
+	while (done < len && cf->len < cf->size) {
+		size_t pos = (cf->head + cf->len) % cf->size;
+		size_t n = len - done;
+		if (n > cf->size - cf->len)
+			n = cf->size - cf->len;
+		if (n > cf->size - pos)
+			n = cf->size - pos;
+		memcpy(&cf->data[pos], &buf[done], n * sizeof(fsample_t));
+		cf->len += n;
+		done += n;
+	}
+	return done;
+}
+
+/* Take out the samples that will not be mixed anymore */
+size_t crossfade_read(struct crossfade *cf, fsample_t *buf, size_t maxlen)
+{
+	size_t ready = cf->final;
+	if (cf->len - cf->final > cf->fade_len)
+		ready = cf->len - cf->fade_len;
+	if (ready > maxlen)
+		ready = maxlen - maxlen % cf->format.channels;
+
+	size_t done = 0;
+	while (done < ready) {
+		size_t n = ready - done;
+		if (n > cf->size - cf->head)
+			n = cf->size - cf->head;
+		memcpy(&buf[done], &cf->data[cf->head], n * sizeof(fsample_t));
+		cf->head = (cf->head + n) % cf->size;
+		done += n;
+	}
+	cf->len -= ready;
+	cf->final -= ready < cf->final ? ready : cf->final;
+	return ready;
+}
+
+/* The song has ended, mix the held audio with what is written next */
+void crossfade_start(struct crossfade *cf)
+{
+	cf->fade_total = cf->len - cf->final;
+	cf->fade_done = 0;
+}
+
+/* Play the held audio as it is */
+void crossfade_finish(struct crossfade *cf)
+{
+	cf->final = cf->len;
+	cf->fade_total = 0;
+	cf->fade_done = 0;
+}
+
+void crossfade_flush(struct crossfade *cf)
+{
+	cf->head = 0;
+	cf->len = 0;
+	cf->final = 0;
+	cf->fade_total = 0;
+	cf->fade_done = 0;
+}
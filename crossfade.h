@@ -0,0 +1,37 @@
+#ifndef _JAPLAY_CROSSFADE_H_
+#define _JAPLAY_CROSSFADE_H_
+
+#include <stdbool.h> /* bool */
+#include <string.h> /* size_t */
+#include "plugin.h"
+
+/*
+ * Holds back the last samples of a song, so they can be mixed with the
+ * beginning of the next song. The held audio is split in two parts: the
+ * "final" samples at the front are ready to be played, the rest may still
+ * be mixed. A zeroed structure is valid.
+ */
+struct crossfade {
+	struct input_format format;
+	unsigned int msecs;
+	fsample_t *data; /* circular */
+	size_t size, head, len, final;
+	size_t fade_len; /* samples held back */
+	size_t fade_total, fade_done; /* fade in progress */
+};
+
+int setup_crossfade(struct crossfade *cf, const struct input_format *format,
+		    unsigned int msecs, size_t chunk);
+size_t crossfade_write(struct crossfade *cf, const fsample_t *buf,
+		       size_t len);
+size_t crossfade_read(struct crossfade *cf, fsample_t *buf, size_t maxlen);
+void crossfade_start(struct crossfade *cf);
+void crossfade_finish(struct crossfade *cf);
+void crossfade_flush(struct crossfade *cf);
+
+static inline bool crossfade_empty(const struct crossfade *cf)
+{
+	return cf->len == 0;
+}
+
+#endif
@@ -0,0 +1,289 @@
+/*
+ * japlay parametric equalizer
+ * Copyright Janne Kulmala 2010
+ *
+ * A cascade of peaking and shelving biquads. The bands are read from the
+ * settings "eq_band1" .. "eq_band16", each one in the form
+ *
+ *	<peak|lowshelf|highshelf> <frequency Hz> <gain dB> [Q]
+ *
+ * The filters run in double precision. Two channels are processed at
+ * once with SSE2, or four with AVX, so stereo costs the same as mono.
+ */
+#include "plugin.h"
+#include "common.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+#define MAX_BANDS	16
+#define MAX_CHANNELS	8
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846
+#endif
+#ifndef M_SQRT1_2
+#define M_SQRT1_2	0.70710678118654752440
+#endif
+
+enum band_type {
+	BAND_PEAK,
+	BAND_LOWSHELF,
+	BAND_HIGHSHELF,
+};
+
+/* Normalized coefficients, a0 is 1 */
+struct band {
+	double b0, b1, b2, a1, a2;
+};
+
+enum simd_level {
+	SIMD_NONE,
+	SIMD_SSE2,
+	SIMD_AVX,
+};
+
+struct dsp_plugin_ctx {
+	unsigned int channels, bands;
+	enum simd_level simd;
+	struct band band[MAX_BANDS];
+	/* transposed direct form II state */
+	double z1[MAX_BANDS][MAX_CHANNELS], z2[MAX_BANDS][MAX_CHANNELS];
+};
+
+static void make_band(struct band *band, enum band_type type, double freq,
+		      double gain, double q, unsigned int rate)
+{
+	double A = pow(10, gain / 40);
+	double w0 = 2 * M_PI * freq / rate;
+	double cs = cos(w0);
+	double alpha = sin(w0) / (2 * q);
+	double sq = 2 * sqrt(A) * alpha;
+	double b0, b1, b2, a0, a1, a2;
+
+	switch (type) {
+	case BAND_LOWSHELF:
+		b0 = A * ((A + 1) - (A - 1) * cs + sq);
+		b1 = 2 * A * ((A - 1) - (A + 1) * cs);
+		b2 = A * ((A + 1) - (A - 1) * cs - sq);
+		a0 = (A + 1) + (A - 1) * cs + sq;
+		a1 = -2 * ((A - 1) + (A + 1) * cs);
+		a2 = (A + 1) + (A - 1) * cs - sq;
+		break;
+	case BAND_HIGHSHELF:
+		b0 = A * ((A + 1) + (A - 1) * cs + sq);
+		b1 = -2 * A * ((A - 1) + (A + 1) * cs);
+		b2 = A * ((A + 1) + (A - 1) * cs - sq);
+		a0 = (A + 1) - (A - 1) * cs + sq;
+		a1 = 2 * ((A - 1) - (A + 1) * cs);
+		a2 = (A + 1) - (A - 1) * cs - sq;
+		break;
+	default:
+		b0 = 1 + alpha * A;
+		b1 = -2 * cs;
+		b2 = 1 - alpha * A;
+		a0 = 1 + alpha / A;
+		a1 = -2 * cs;
+		a2 = 1 - alpha / A;
+		break;
+	}
+	band->b0 = b0 / a0;
+	band->b1 = b1 / a0;
+	band->b2 = b2 / a0;
+	band->a1 = a1 / a0;
+	band->a2 = a2 / a0;
+}
+
+/* Returns false if the setting is missing or invalid */
+static bool parse_band(struct band *band, const char *str, unsigned int rate)
+{
+	char type[16];
+	double freq, gain, q = 0;
+	int n = sscanf(str, "%15s %lf %lf %lf", type, &freq, &gain, &q);
+	if (n < 3) {
+		warning("invalid EQ band: %s\n", str);
+		return false;
+	}
+
+	enum band_type t;
+	if (strcmp(type, "peak") == 0)
+		t = BAND_PEAK;
+	else if (strcmp(type, "lowshelf") == 0)
+		t = BAND_LOWSHELF;
+	else if (strcmp(type, "highshelf") == 0)
+		t = BAND_HIGHSHELF;
+	else {
+		warning("invalid EQ band type: %s\n", type);
+		return false;
+	}
+	if (q <= 0)
+		q = t == BAND_PEAK ? 1.0 : M_SQRT1_2;
+
+	/* a band without gain does nothing */
+	if (gain == 0 || freq <= 0 || freq >= rate * 0.49)
+		return false;
+	make_band(band, t, freq, gain, q, rate);
+	return true;
+}
+
+static void band_c(const struct band *bd, double *z1, double *z2,
+		   fsample_t *buf, size_t frames, unsigned int stride)
+{
+	double s1 = *z1, s2 = *z2;
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		double x = buf[i * stride];
+		double y = bd->b0 * x + s1;
+		s1 = bd->b1 * x - bd->a1 * y + s2;
+		s2 = bd->b2 * x - bd->a2 * y;
+		buf[i * stride] = y;
+	}
+	*z1 = s1;
+	*z2 = s2;
+}
+
+#ifdef HAVE_X86
+
+/* Two adjacent channels */
+__attribute__((target("sse2")))
+static void band_sse2(const struct band *bd, double *z1, double *z2,
+		      fsample_t *buf, size_t frames, unsigned int stride)
+{
+	const __m128d b0 = _mm_set1_pd(bd->b0), b1 = _mm_set1_pd(bd->b1);
+	const __m128d b2 = _mm_set1_pd(bd->b2), a1 = _mm_set1_pd(bd->a1);
+	const __m128d a2 = _mm_set1_pd(bd->a2);
+	__m128d s1 = _mm_loadu_pd(z1), s2 = _mm_loadu_pd(z2);
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		fsample_t *p = &buf[i * stride];
+		__m128d x = _mm_cvtps_pd(_mm_castsi128_ps(
+			_mm_loadl_epi64((const __m128i *) p)));
+		__m128d y = _mm_add_pd(_mm_mul_pd(b0, x), s1);
+		s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(b1, x),
+					   _mm_mul_pd(a1, y)), s2);
+		s2 = _mm_sub_pd(_mm_mul_pd(b2, x), _mm_mul_pd(a2, y));
+		_mm_storel_pi((__m64 *) p, _mm_cvtpd_ps(y));
+	}
+	_mm_storeu_pd(z1, s1);
+	_mm_storeu_pd(z2, s2);
+}
+
+/* Four adjacent channels */
+__attribute__((target("avx")))
+static void band_avx(const struct band *bd, double *z1, double *z2,
+		     fsample_t *buf, size_t frames, unsigned int stride)
+{
+	const __m256d b0 = _mm256_set1_pd(bd->b0);
+	const __m256d b1 = _mm256_set1_pd(bd->b1);
+	const __m256d b2 = _mm256_set1_pd(bd->b2);
+	const __m256d a1 = _mm256_set1_pd(bd->a1);
+	const __m256d a2 = _mm256_set1_pd(bd->a2);
+	__m256d s1 = _mm256_loadu_pd(z1), s2 = _mm256_loadu_pd(z2);
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		fsample_t *p = &buf[i * stride];
+		__m256d x = _mm256_cvtps_pd(_mm_loadu_ps(p));
+		__m256d y = _mm256_add_pd(_mm256_mul_pd(b0, x), s1);
+		s1 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(b1, x),
+						 _mm256_mul_pd(a1, y)), s2);
+		s2 = _mm256_sub_pd(_mm256_mul_pd(b2, x),
+				   _mm256_mul_pd(a2, y));
+		_mm_storeu_ps(p, _mm256_cvtpd_ps(y));
+	}
+	_mm256_storeu_pd(z1, s1);
+	_mm256_storeu_pd(z2, s2);
+}
+
+#endif
+
+static void eq_reset(struct dsp_plugin_ctx *ctx)
+{
+	memset(ctx->z1, 0, sizeof(ctx->z1));
+	memset(ctx->z2, 0, sizeof(ctx->z2));
+}
+
+static int eq_configure(struct dsp_plugin_ctx *ctx,
+			const struct input_format *format)
+{
+	unsigned int i;
+	if (format->channels > MAX_CHANNELS)
+		return -1;
+	ctx->channels = format->channels;
+	ctx->bands = 0;
+	for (i = 1; i <= MAX_BANDS; ++i) {
+		char name[16];
+		sprintf(name, "eq_band%u", i);
+		const char *str = get_setting(name);
+		if (str && parse_band(&ctx->band[ctx->bands], str,
+				      format->rate))
+			ctx->bands++;
+	}
+	info("EQ: %u bands\n", ctx->bands);
+
+	ctx->simd = SIMD_NONE;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		ctx->simd = SIMD_AVX;
+	else if (__builtin_cpu_supports("sse2"))
+		ctx->simd = SIMD_SSE2;
+#endif
+	eq_reset(ctx);
+	return 0;
+}
+
+static void eq_process(struct dsp_plugin_ctx *ctx, fsample_t *buffer,
+		       size_t len)
+{
+	unsigned int channels = ctx->channels;
+	size_t frames = len / channels;
+	unsigned int b, ch;
+
+	for (b = 0; b < ctx->bands; ++b) {
+		const struct band *bd = &ctx->band[b];
+		double *z1 = ctx->z1[b], *z2 = ctx->z2[b];
+		ch = 0;
+#ifdef HAVE_X86
+		if (ctx->simd >= SIMD_AVX) {
+			for (; ch + 4 <= channels; ch += 4)
+				band_avx(bd, &z1[ch], &z2[ch], &buffer[ch],
+					 frames, channels);
+		}
+		if (ctx->simd >= SIMD_SSE2) {
+			for (; ch + 2 <= channels; ch += 2)
+				band_sse2(bd, &z1[ch], &z2[ch], &buffer[ch],
+					  frames, channels);
+		}
+#endif
+		for (; ch < channels; ++ch)
+			band_c(bd, &z1[ch], &z2[ch], &buffer[ch], frames,
+			       channels);
+
+		/* avoid denormals during silence */
+		for (ch = 0; ch < channels; ++ch) {
+			if (fabs(z1[ch]) + fabs(z2[ch]) < 1e-30)
+				z1[ch] = z2[ch] = 0;
+		}
+	}
+}
+
+static struct dsp_plugin plugin_info = {
+	.size = sizeof(struct dsp_plugin),
+	.ctx_size = sizeof(struct dsp_plugin_ctx),
+	.name = "Parametric equalizer",
+	.short_name = "eq",
+	.configure = eq_configure,
+	.process = eq_process,
+	.reset = eq_reset,
+};
+
+struct dsp_plugin *get_dsp_plugin()
+{
+	return &plugin_info;
+}
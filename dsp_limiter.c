@@ -0,0 +1,461 @@
+/*
+ * japlay look-ahead limiter
+ * Copyright Janne Kulmala 2010
+ *
+ * Keeps the samples below a ceiling without clipping them. The audio is
+ * delayed by a few milliseconds, so the gain can be brought down smoothly
+ * before a peak arrives. Optionally compresses the louder parts first.
+ *
+ * Settings:
+ *	limiter_ceiling_db	highest output level in dBFS, default -1
+ *	limiter_lookahead_msecs	default 5
+ *	limiter_release_msecs	default 100
+ *	compressor_threshold_db	level where compression starts, default -12
+ *	compressor_ratio	default 1, no compression
+ */
+#include "plugin.h"
+#include "common.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+#define BLOCK		256 /* frames processed at a time */
+#define COMP_BLOCK	32 /* frames per compressor gain update */
+#define MAX_LOOKAHEAD	50 /* msecs */
+
+struct dsp_plugin_ctx {
+	unsigned int channels;
+	size_t lookahead; /* frames */
+	float ceiling;
+	float release;
+	bool simd;
+
+	/* compressor */
+	float threshold, slope, env, attack_coef, release_coef;
+
+	/* sliding minimum of the target gain over the look-ahead */
+	float *min_val;
+	size_t *min_idx;
+	size_t min_head, min_count, frame;
+
+	/* moving average of the minimum */
+	float *avg;
+	size_t avg_pos;
+	double avg_sum;
+
+	float gain;
+
+	/* the frames still in the delay followed by the current block. The
+	   smoothing covers a gain change in lookahead - 1 frames, which is
+	   how many the delay holds once filled. */
+	fsample_t *delay;
+	size_t held; /* frames in the delay */
+	size_t silent; /* trailing frames of it added by draining */
+
+	float peaks[BLOCK], gains[BLOCK];
+};
+
+static float db_to_gain(float db)
+{
+	return powf(10, db / 20);
+}
+
+/* Largest absolute sample of each frame */
+static void frame_peaks_c(float *peaks, const fsample_t *buf, size_t frames,
+			  unsigned int channels)
+{
+	size_t i;
+	unsigned int ch;
+	for (i = 0; i < frames; ++i) {
+		float peak = 0;
+		for (ch = 0; ch < channels; ++ch) {
+			if (fabsf(buf[ch]) > peak)
+				peak = fabsf(buf[ch]);
+		}
+		peaks[i] = peak;
+		buf += channels;
+	}
+}
+
+/* Gain that brings each frame below the ceiling, limited to "comp" */
+static void limit_gains_c(float *gains, const float *peaks, size_t frames,
+			  float ceiling, float comp)
+{
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		float g = peaks[i] > ceiling ? ceiling / peaks[i] : 1;
+		gains[i] = g < comp ? g : comp;
+	}
+}
+
+static void apply_gains_c(fsample_t *dst, const fsample_t *src,
+			  const float *gains, size_t frames,
+			  unsigned int channels)
+{
+	size_t i;
+	unsigned int ch;
+	for (i = 0; i < frames; ++i) {
+		for (ch = 0; ch < channels; ++ch)
+			dst[ch] = src[ch] * gains[i];
+		dst += channels;
+		src += channels;
+	}
+}
+
+#ifdef HAVE_X86
+
+/* Mono and stereo are vectorized, other layouts use the C versions */
+
+__attribute__((target("sse2")))
+static void frame_peaks_sse2(float *peaks, const fsample_t *buf,
+			     size_t frames, unsigned int channels)
+{
+	const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	size_t i = 0;
+	if (channels == 1) {
+		for (; i + 4 <= frames; i += 4)
+			_mm_storeu_ps(&peaks[i],
+				      _mm_and_ps(_mm_loadu_ps(&buf[i]), mask));
+	} else if (channels == 2) {
+		for (; i + 4 <= frames; i += 4) {
+			__m128 a = _mm_and_ps(_mm_loadu_ps(&buf[i * 2]), mask);
+			__m128 b = _mm_and_ps(_mm_loadu_ps(&buf[i * 2 + 4]),
+					      mask);
+			__m128 left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+			__m128 right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+			_mm_storeu_ps(&peaks[i], _mm_max_ps(left, right));
+		}
+	}
+	frame_peaks_c(&peaks[i], &buf[i * channels], frames - i, channels);
+}
+
+__attribute__((target("sse2")))
+static void limit_gains_sse2(float *gains, const float *peaks, size_t frames,
+			     float ceiling, float comp)
+{
+	const __m128 c = _mm_set1_ps(ceiling), m = _mm_set1_ps(comp);
+	size_t i;
+	for (i = 0; i + 4 <= frames; i += 4) {
+		/* ceiling / max(peak, ceiling) is at most one */
+		__m128 g = _mm_div_ps(c, _mm_max_ps(_mm_loadu_ps(&peaks[i]), c));
+		_mm_storeu_ps(&gains[i], _mm_min_ps(g, m));
+	}
+	limit_gains_c(&gains[i], &peaks[i], frames - i, ceiling, comp);
+}
+
+__attribute__((target("sse2")))
+static void apply_gains_sse2(fsample_t *dst, const fsample_t *src,
+			     const float *gains, size_t frames,
+			     unsigned int channels)
+{
+	size_t i = 0;
+	if (channels == 1) {
+		for (; i + 4 <= frames; i += 4)
+			_mm_storeu_ps(&dst[i], _mm_mul_ps(_mm_loadu_ps(&src[i]),
+							  _mm_loadu_ps(&gains[i])));
+	} else if (channels == 2) {
+		for (; i + 4 <= frames; i += 4) {
+			__m128 g = _mm_loadu_ps(&gains[i]);
+			__m128 a = _mm_mul_ps(_mm_loadu_ps(&src[i * 2]),
+					      _mm_unpacklo_ps(g, g));
+			__m128 b = _mm_mul_ps(_mm_loadu_ps(&src[i * 2 + 4]),
+					      _mm_unpackhi_ps(g, g));
+			_mm_storeu_ps(&dst[i * 2], a);
+			_mm_storeu_ps(&dst[i * 2 + 4], b);
+		}
+	}
+	apply_gains_c(&dst[i * channels], &src[i * channels], &gains[i],
+		      frames - i, channels);
+}
+
+#endif
+
+static void limiter_close(struct dsp_plugin_ctx *ctx)
+{
+	free(ctx->min_val);
+	free(ctx->min_idx);
+	free(ctx->avg);
+	free(ctx->delay);
+	ctx->min_val = NULL;
+	ctx->min_idx = NULL;
+	ctx->avg = NULL;
+	ctx->delay = NULL;
+}
+
+static void limiter_reset(struct dsp_plugin_ctx *ctx)
+{
+	size_t i;
+	ctx->min_head = 0;
+	ctx->min_count = 0;
+	ctx->frame = 0;
+	for (i = 0; i < ctx->lookahead; ++i)
+		ctx->avg[i] = 1;
+	ctx->avg_pos = 0;
+	ctx->avg_sum = ctx->lookahead;
+	ctx->gain = 1;
+	ctx->env = 0;
+	/* filled from the audio that follows */
+	ctx->held = 0;
+	ctx->silent = 0;
+}
+
+static int limiter_configure(struct dsp_plugin_ctx *ctx,
+			     const struct input_format *format)
+{
+	limiter_close(ctx);
+
+	ctx->channels = format->channels;
+	ctx->ceiling = db_to_gain(get_setting_int("limiter_ceiling_db", -1));
+	if (ctx->ceiling > 1)
+		ctx->ceiling = 1;
+
+	int msecs = get_setting_int("limiter_lookahead_msecs", 5);
+	if (msecs < 1)
+		msecs = 1;
+	if (msecs > MAX_LOOKAHEAD)
+		msecs = MAX_LOOKAHEAD;
+	ctx->lookahead = (size_t) format->rate * msecs / 1000;
+	if (ctx->lookahead < 1)
+		ctx->lookahead = 1;
+
+	msecs = get_setting_int("limiter_release_msecs", 100);
+	if (msecs < 1)
+		msecs = 1;
+	ctx->release = 1 - expf(-1000.0f / (msecs * (float) format->rate));
+
+	int ratio = get_setting_int("compressor_ratio", 1);
+	ctx->slope = ratio > 1 ? 1.0f / ratio - 1 : 0;
+	ctx->threshold = db_to_gain(get_setting_int("compressor_threshold_db",
+						    -12));
+	/* 10 ms attack, 200 ms release, updated once per COMP_BLOCK */
+	ctx->attack_coef = 1 - expf(-COMP_BLOCK * 100.0f / format->rate);
+	ctx->release_coef = 1 - expf(-COMP_BLOCK * 5.0f / format->rate);
+
+	ctx->min_val = malloc(sizeof(float) * ctx->lookahead);
+	ctx->min_idx = malloc(sizeof(size_t) * ctx->lookahead);
+	ctx->avg = malloc(sizeof(float) * ctx->lookahead);
+	ctx->delay = malloc(sizeof(fsample_t) * (ctx->lookahead + BLOCK) *
+			    ctx->channels);
+	if (ctx->min_val == NULL || ctx->min_idx == NULL || ctx->avg == NULL ||
+	    ctx->delay == NULL) {
+		limiter_close(ctx);
+		return -1;
+	}
+
+	ctx->simd = false;
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	ctx->simd = __builtin_cpu_supports("sse2");
+#endif
+	limiter_reset(ctx);
+	info("limiter: ceiling %.2f, look-ahead %zu frames\n", ctx->ceiling,
+	     ctx->lookahead);
+	return 0;
+}
+
+/* Compressor gain for the next COMP_BLOCK frames */
+static float compress(struct dsp_plugin_ctx *ctx, const float *peaks,
+		      size_t frames)
+{
+	float level = 0;
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		if (peaks[i] > level)
+			level = peaks[i];
+	}
+	ctx->env += (level - ctx->env) *
+		(level > ctx->env ? ctx->attack_coef : ctx->release_coef);
+	if (ctx->env <= ctx->threshold)
+		return 1;
+	return powf(ctx->env / ctx->threshold, ctx->slope);
+}
+
+/*
+ * Turns the target gain of each frame into the gain that is applied to
+ * the frame leaving the delay. Taking the minimum over the look-ahead and
+ * then averaging over the same length makes the gain ramp down in time
+ * for every peak, and never rise above what any frame still in the delay
+ * needs.
+ */
+static void smooth_gains(struct dsp_plugin_ctx *ctx, float *gains,
+			 size_t frames)
+{
+	size_t L = ctx->lookahead, i;
+	for (i = 0; i < frames; ++i) {
+		float g = gains[i];
+
+		while (ctx->min_count) {
+			size_t back = (ctx->min_head + ctx->min_count - 1) % L;
+			if (ctx->min_val[back] < g)
+				break;
+			ctx->min_count--;
+		}
+		if (ctx->min_count &&
+		    ctx->min_idx[ctx->min_head] + L <= ctx->frame) {
+			ctx->min_head = (ctx->min_head + 1) % L;
+			ctx->min_count--;
+		}
+		size_t back = (ctx->min_head + ctx->min_count) % L;
+		ctx->min_val[back] = g;
+		ctx->min_idx[back] = ctx->frame;
+		ctx->min_count++;
+		ctx->frame++;
+
+		ctx->avg_sum += ctx->min_val[ctx->min_head] - ctx->avg[ctx->avg_pos];
+		ctx->avg[ctx->avg_pos] = ctx->min_val[ctx->min_head];
+		if (++ctx->avg_pos == L) {
+			/* do not let rounding errors accumulate */
+			size_t k;
+			ctx->avg_pos = 0;
+			ctx->avg_sum = 0;
+			for (k = 0; k < L; ++k)
+				ctx->avg_sum += ctx->avg[k];
+		}
+		g = ctx->avg_sum / L;
+
+		/* instant attack, the average is already smooth */
+		if (g < ctx->gain)
+			ctx->gain = g;
+		else
+			ctx->gain += (g - ctx->gain) * ctx->release;
+		gains[i] = ctx->gain;
+	}
+}
+
+/* Take the input frames, silence if in is NULL, and write the frames
+   that leave the delay to out. Returns the number of frames written,
+   which is less than given while the delay fills up. */
+static size_t process_block(struct dsp_plugin_ctx *ctx, fsample_t *out,
+			    const fsample_t *in, size_t frames)
+{
+	unsigned int channels = ctx->channels;
+	size_t hist = ctx->lookahead - 1, i;
+	fsample_t *delay = ctx->delay;
+	void (*frame_peaks)(float *, const fsample_t *, size_t, unsigned int)
+		= frame_peaks_c;
+	void (*limit_gains)(float *, const float *, size_t, float, float)
+		= limit_gains_c;
+	void (*apply_gains)(fsample_t *, const fsample_t *, const float *,
+			    size_t, unsigned int) = apply_gains_c;
+#ifdef HAVE_X86
+	if (ctx->simd) {
+		frame_peaks = frame_peaks_sse2;
+		limit_gains = limit_gains_sse2;
+		apply_gains = apply_gains_sse2;
+	}
+#endif
+
+	if (in)
+		frame_peaks(ctx->peaks, in, frames, channels);
+	else
+		memset(ctx->peaks, 0, sizeof(float) * frames);
+	for (i = 0; i < frames; i += COMP_BLOCK) {
+		size_t n = frames - i < COMP_BLOCK ? frames - i : COMP_BLOCK;
+		float comp = 1;
+		if (ctx->slope)
+			comp = compress(ctx, &ctx->peaks[i], n);
+		limit_gains(&ctx->gains[i], &ctx->peaks[i], n, ctx->ceiling,
+			    comp);
+	}
+	smooth_gains(ctx, ctx->gains, frames);
+
+	/* the gain computed when a frame enters is applied to the frame
+	   hist frames before it */
+	fsample_t *end = &delay[ctx->held * channels];
+	if (in)
+		memcpy(end, in, sizeof(fsample_t) * frames * channels);
+	else
+		memset(end, 0, sizeof(fsample_t) * frames * channels);
+	size_t total = ctx->held + frames;
+	size_t n = total > hist ? total - hist : 0;
+	if (n)
+		apply_gains(out, delay, &ctx->gains[hist - ctx->held], n,
+			    channels);
+	ctx->held = total - n;
+	memmove(delay, &delay[n * channels],
+		sizeof(fsample_t) * ctx->held * channels);
+	return n;
+}
+
+/* The delay starts with the first frames after a reset, the output is
+   shorter by the look-ahead until then */
+static size_t limiter_process_delayed(struct dsp_plugin_ctx *ctx,
+				      fsample_t *buffer, size_t len)
+{
+	size_t frames = len / ctx->channels, written = 0;
+	const fsample_t *in = buffer;
+	while (frames) {
+		size_t n = frames < BLOCK ? frames : BLOCK;
+		written += process_block(ctx, &buffer[written * ctx->channels],
+					 in, n);
+		in += n * ctx->channels;
+		frames -= n;
+	}
+	return written * ctx->channels;
+}
+
+/* Hosts without process_delayed get the delay filled with silence */
+static void limiter_process(struct dsp_plugin_ctx *ctx, fsample_t *buffer,
+			    size_t len)
+{
+	size_t hist = ctx->lookahead - 1;
+	if (ctx->held < hist) {
+		memmove(&ctx->delay[(hist - ctx->held) * ctx->channels],
+			ctx->delay,
+			sizeof(fsample_t) * ctx->held * ctx->channels);
+		memset(ctx->delay, 0,
+		       sizeof(fsample_t) * (hist - ctx->held) * ctx->channels);
+		ctx->held = hist;
+	}
+	limiter_process_delayed(ctx, buffer, len);
+}
+
+/* Push silence through until the audio in the delay is out */
+static size_t limiter_drain(struct dsp_plugin_ctx *ctx, fsample_t *buffer,
+			    size_t maxlen)
+{
+	size_t hist = ctx->lookahead - 1;
+	size_t max = maxlen / ctx->channels, written = 0;
+	while (written < max && ctx->held > ctx->silent) {
+		size_t want = ctx->held - ctx->silent;
+		if (want > max - written)
+			want = max - written;
+		/* writes held + n - hist frames */
+		size_t n = want + hist - ctx->held;
+		if (n > BLOCK)
+			n = BLOCK;
+		written += process_block(ctx, &buffer[written * ctx->channels],
+					 NULL, n);
+		ctx->silent += n;
+		if (ctx->silent > ctx->held)
+			ctx->silent = ctx->held;
+	}
+	if (ctx->held == ctx->silent)
+		/* start over with the next audio */
+		limiter_reset(ctx);
+	return written * ctx->channels;
+}
+
+static struct dsp_plugin plugin_info = {
+	.size = sizeof(struct dsp_plugin),
+	.ctx_size = sizeof(struct dsp_plugin_ctx),
+	.name = "Look-ahead limiter",
+	.short_name = "limiter",
+	.configure = limiter_configure,
+	.process = limiter_process,
+	.reset = limiter_reset,
+	.close = limiter_close,
+	.limiter = true,
+	.process_delayed = limiter_process_delayed,
+	.drain = limiter_drain,
+};
+
+struct dsp_plugin *get_dsp_plugin()
+{
+	return &plugin_info;
+}
@@ -44,6 +44,11 @@ struct input_plugin_ctx {
 	unsigned char buffer[8192];
 	size_t buflen;
 
+	/* synthesized frame, the part that did not fit in the last fillbuf
+	   call is returned first */
+	struct input_format format;
+	unsigned int pcm_pos, pcm_len;
+
 	/* URL */
 	char *host;
 	const char *path;
@@ -411,19 +416,10 @@ static void mad_close(struct input_plugin_ctx *ctx)
 	ctx->nseconds = 0;
 }
 
-static sample_t scale(mad_fixed_t sample)
+static fsample_t scale(mad_fixed_t sample)
 {
-	/* round */
-	sample += (1L << (MAD_F_FRACBITS - 16));
-
-	/* clip */
-	if (sample >= MAD_F_ONE)
-		sample = MAD_F_ONE - 1;
-	else if (sample < -MAD_F_ONE)
-		sample = -MAD_F_ONE;
-
-	/* quantize */
-	return sample >> (MAD_F_FRACBITS + 1 - 16);
+	/* no clipping, the engine does it when converting for output */
+	return sample * (1.0f / MAD_F_ONE);
 }
 
 static void print_mad_error(const struct mad_stream *stream)
@@ -472,10 +468,11 @@ static int read_meta(struct input_plugin_ctx *ctx)
 	return 0;
 }
 
-static size_t mad_fillbuf(struct input_plugin_ctx *ctx, sample_t *buffer,
-			  size_t maxlen, struct input_format *format)
+/* Decode and synthesize the next frame. "pending" is the number of
+   samples decoded but not yet returned to the player. Returns 1 at the
+   end of the file and -1 in case of an error. */
+static int decode_frame(struct input_plugin_ctx *ctx, size_t pending)
 {
-	size_t t, len;
 	while (true) {
 		/* remove decoded data from the read buffer */
 		if (ctx->stream.next_frame) {
@@ -487,21 +484,17 @@ static size_t mad_fillbuf(struct input_plugin_ctx *ctx, sample_t *buffer,
 
 		if (ctx->metainterval && ctx->metapos < ctx->buflen) {
 			if (read_meta(ctx))
-				return 0;
+				return -1;
 		}
 		mad_stream_buffer(&ctx->stream, ctx->buffer, ctx->buflen);
 
 		if (mad_header_decode(&ctx->frame.header, &ctx->stream)) {
 			if (ctx->stream.error == MAD_ERROR_BUFLEN) {
 				/* not enought data the in read buffer */
-				if (ctx->eof) {
-					set_song_length(get_input_song(ctx->state),
-						japlay_get_position(ctx->state),
-						ctx->reliable ? 100 : 10);
-					return 0;
-				}
+				if (ctx->eof)
+					return 1;
 				if (fillbuf(ctx))
-					return 0;
+					return -1;
 			} else
 				print_mad_error(&ctx->stream);
 			continue;
@@ -512,44 +505,79 @@ static size_t mad_fillbuf(struct input_plugin_ctx *ctx, sample_t *buffer,
 			continue;
 		}
 
-		if (ctx->reliable) {
-			t = japlay_get_position(ctx->state) / 1000;
+		if (ctx->reliable && ctx->format.rate) {
+			unsigned int t = (japlay_get_position(ctx->state) +
+				pending * 1000 / (ctx->format.rate *
+						  ctx->format.channels)) / 1000;
 			if (t != ctx->lastslot)
 				remember(ctx, ctx->fpos, t);
 			ctx->lastslot = t;
 		}
 
-		format->rate = ctx->frame.header.samplerate;
-		format->channels = MAD_NCHANNELS(&ctx->frame.header);
+		ctx->format.rate = ctx->frame.header.samplerate;
+		ctx->format.channels = MAD_NCHANNELS(&ctx->frame.header);
 
 		mad_synth_frame(&ctx->synth, &ctx->frame);
+		ctx->pcm_pos = 0;
+		ctx->pcm_len = ctx->synth.pcm.length;
+		return 0;
+	}
+}
 
-		len = ctx->synth.pcm.length * format->channels;
-		if (len > maxlen) {
-			warning("Too small buffer!\n");
-			return 0;
+/* Decodes as many frames as fit in the buffer */
+static size_t mad_fillbuf(struct input_plugin_ctx *ctx, fsample_t *buffer,
+			  size_t maxlen, struct input_format *format)
+{
+	size_t filled = 0;
+	while (true) {
+		if (ctx->pcm_pos == ctx->pcm_len) {
+			int ret = decode_frame(ctx, filled);
+			if (ret > 0 && !filled)
+				set_song_length(get_input_song(ctx->state),
+						japlay_get_position(ctx->state),
+						ctx->reliable ? 100 : 10);
+			if (ret)
+				break;
 		}
+		/* one call returns a single format */
+		if (filled && (ctx->format.rate != format->rate ||
+			       ctx->format.channels != format->channels))
+			break;
+		*format = ctx->format;
+
+		unsigned int channels = format->channels;
+		size_t n = ctx->pcm_len - ctx->pcm_pos;
+		if (n > (maxlen - filled) / channels)
+			n = (maxlen - filled) / channels;
+		if (n == 0)
+			break;
 
-		if (format->channels == 2) {
-			size_t i;
-			for (i = 0; i < ctx->synth.pcm.length; ++i) {
-				buffer[i * 2] = scale(ctx->synth.pcm.samples[0][i]);
-				buffer[i * 2 + 1] = scale(ctx->synth.pcm.samples[1][i]);
+		const mad_fixed_t *left = &ctx->synth.pcm.samples[0][ctx->pcm_pos];
+		const mad_fixed_t *right = &ctx->synth.pcm.samples[1][ctx->pcm_pos];
+		fsample_t *out = &buffer[filled];
+		size_t i;
+		if (channels == 2) {
+			for (i = 0; i < n; ++i) {
+				out[i * 2] = scale(left[i]);
+				out[i * 2 + 1] = scale(right[i]);
 			}
-		} else if (format->channels == 1) {
-			size_t i;
-			for (i = 0; i < ctx->synth.pcm.length; ++i)
-				buffer[i] = scale(ctx->synth.pcm.samples[0][i]);
+		} else {
+			for (i = 0; i < n; ++i)
+				out[i] = scale(left[i]);
 		}
-
-		return len;
+		ctx->pcm_pos += n;
+		filled += n * channels;
 	}
+	return filled;
 }
 
 static int accurate_seek(struct input_plugin_ctx *ctx, struct songpos *newpos)
 {
 	unsigned int cur_pos = japlay_get_position(ctx->state);
 
+	/* the rest of the last frame is before the new position */
+	ctx->pcm_pos = ctx->pcm_len = 0;
+
 	if (newpos->msecs < cur_pos) {
 		/* rewind to the beginning */
 		mad_frame_mute(&ctx->frame);
@@ -644,6 +672,7 @@ static int fast_seek(struct input_plugin_ctx *ctx, struct songpos *newpos)
 	mad_synth_mute(&ctx->synth);
 	mad_stream_finish(&ctx->stream);
 	mad_stream_init(&ctx->stream);
+	ctx->pcm_pos = ctx->pcm_len = 0;
 	return 1;
 }
 
@@ -666,9 +695,10 @@ static struct input_plugin plugin_info = {
 	.detect = mad_detect,
 	.open = mad_open,
 	.close = mad_close,
-	.fillbuf = mad_fillbuf,
 	.seek = mad_seek,
 	.mime_types = mime_types,
+	.fillbuf_float = mad_fillbuf,
+	.fill_buffer = true,
 };
 
 
@@ -256,8 +256,10 @@ static struct input_plugin plugin_info = {
 	.open = mikmod_open,
 	.close = mikmod_close,
 	.fillbuf = mikmod_fillbuf,
+	.fill_buffer = true, /* the mixer renders as much as asked */
 	.seek = mikmod_seek,
 	.mime_types = mime_types,
+	.single_instance = true, /* libmikmod has a single global player */
 };
 
 struct input_plugin *get_input_plugin()
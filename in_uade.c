@@ -9,6 +9,7 @@
 #include "playlist.h"
 #include "utils.h"
 #include "plugin.h"
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -17,6 +18,11 @@ static struct uade_state *scanstate;
 
 struct input_plugin_ctx {
 	struct uade_state *play;
+	bool ended;
+
+	/* audio that did not fit in the last fillbuf call */
+	char *left;
+	size_t left_pos, left_len, left_size;
 };
 
 static int init_uade(struct input_plugin_ctx *ctx)
@@ -74,6 +80,25 @@ static int uade_open(struct input_plugin_ctx *ctx, struct input_state *state,
 static void uade_close(struct input_plugin_ctx *ctx)
 {
 	uade_stop(ctx->play);
+	free(ctx->left);
+}
+
+/* Keep the rest of the data event for the next fillbuf call */
+static void keep_left(struct input_plugin_ctx *ctx, const char *data,
+		      size_t len)
+{
+	if (len > ctx->left_size) {
+		char *left = realloc(ctx->left, len);
+		if (left == NULL) {
+			warning("uade: out of memory, sound data is discarded\n");
+			return;
+		}
+		ctx->left = left;
+		ctx->left_size = len;
+	}
+	memcpy(ctx->left, data, len);
+	ctx->left_pos = 0;
+	ctx->left_len = len;
 }
 
 static const char *get_fname(struct uade_state *state)
@@ -81,50 +106,66 @@ static const char *get_fname(struct uade_state *state)
 	return uade_get_song_info(state)->modulefname;
 }
 
+/* Collects data events until the buffer is full */
 static size_t uade_fillbuf(struct input_plugin_ctx *ctx, sample_t *buffer,
 			  size_t maxlen, struct input_format *format)
 {
 	struct uade_event event;
-	size_t len;
+	char *dst = (char *) buffer;
+	/* whole stereo frames */
+	size_t size = maxlen / 2 * 2 * sizeof(sample_t), filled, len;
 
-	UNUSED(ctx);
 	format->channels = 2;
 	format->rate = 44100;
 
-	while (1) {
+	filled = ctx->left_len - ctx->left_pos;
+	if (filled > size)
+		filled = size;
+	if (filled) {
+		memcpy(dst, &ctx->left[ctx->left_pos], filled);
+		ctx->left_pos += filled;
+	}
+
+	while (filled < size && !ctx->ended) {
 		if (uade_get_event(&event, ctx->play)) {
 			fprintf(stderr, "uade_get_event(): error!\n");
+			ctx->ended = true;
 			break;
 		}
 
 		switch (event.type) {
 		case UADE_EVENT_EAGAIN:
+			/* return what there is instead of waiting */
+			if (filled)
+				return filled / sizeof(sample_t);
 			break;
 		case UADE_EVENT_DATA:
 			len = event.data.size;
-			if (maxlen < len) {
-				fprintf(stderr, "japlay's fillbuf maxsize is too small. Sound data is discarded!\n");
-				len = maxlen;
+			if (len > size - filled) {
+				keep_left(ctx, (const char *) event.data.data +
+					  (size - filled), len - (size - filled));
+				len = size - filled;
 			}
-			memcpy(buffer, event.data.data, len);
-			return len / sizeof(sample_t);
+			memcpy(&dst[filled], event.data.data, len);
+			filled += len;
+			break;
 		case UADE_EVENT_MESSAGE:
 			fprintf(stderr, "uade: %s\n", event.msg);
 			break;
 		case UADE_EVENT_SONG_END:
 			if (!event.songend.happy) {
 				fprintf(stderr, "uade: unhappy song end: %s (%s)\n", event.songend.reason, get_fname(ctx->play));
-				return 0;
-			}
-			if (uade_next_subsong(ctx->play))
-				return 0;
+				ctx->ended = true;
+			} else if (uade_next_subsong(ctx->play))
+				ctx->ended = true;
 			break;
 		default:
-			fprintf(stderr, "uade_get_event returned %s which is not handled.\n", uade_event_name(&event));			
-			return 0;
+			fprintf(stderr, "uade_get_event returned %s which is not handled.\n", uade_event_name(&event));
+			ctx->ended = true;
+			break;
 		}
 	}
-	return 0;
+	return filled / sizeof(sample_t);
 }
 
 static struct input_plugin plugin_info = {
@@ -135,6 +176,7 @@ static struct input_plugin plugin_info = {
 	.open = uade_open,
 	.close = uade_close,
 	.fillbuf = uade_fillbuf,
+	.fill_buffer = true,
 };
 
 struct input_plugin *get_input_plugin()
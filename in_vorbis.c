@@ -15,6 +15,12 @@ struct input_plugin_ctx {
 	OggVorbis_File vf;
 	int fd;
 	bool reliable;
+
+	/* decoded samples that did not fit in the last fillbuf call. They
+	   stay valid in the decoder until the next read or seek. */
+	float **pcm;
+	long pcm_pos, pcm_len;
+	struct input_format format;
 };
 
 static bool vorbis_detect(const char *filename)
@@ -82,30 +88,64 @@ static void vorbis_close(struct input_plugin_ctx *ctx)
 	close(ctx->fd);
 }
 
-static size_t vorbis_fillbuf(struct input_plugin_ctx *ctx, sample_t *buffer,
+/* Reads packets until the buffer is full */
+static size_t vorbis_fillbuf(struct input_plugin_ctx *ctx, fsample_t *buffer,
 			  size_t maxlen, struct input_format *format)
 {
+	size_t filled = 0;
 	while (true) {
-		int bitstream;
-		long n = ov_read(&ctx->vf, (char *)buffer, maxlen * sizeof(sample_t),
-			0, 2, 1, &bitstream);
-		if (n == OV_HOLE)
-			continue;
-
-		if (n <= 0) {
-			set_song_length(get_input_song(ctx->state),
-					japlay_get_position(ctx->state),
-					ctx->reliable ? 100 : 10);
-			return 0;
+		if (ctx->pcm_pos == ctx->pcm_len) {
+			vorbis_info *vi = ov_info(&ctx->vf, -1);
+			long frames = (maxlen - filled) / vi->channels;
+			if (frames == 0)
+				break;
+			int bitstream;
+			long n = ov_read_float(&ctx->vf, &ctx->pcm, frames,
+					       &bitstream);
+			if (n == OV_HOLE)
+				continue;
+
+			if (n <= 0) {
+				if (!filled)
+					set_song_length(get_input_song(ctx->state),
+							japlay_get_position(ctx->state),
+							ctx->reliable ? 100 : 10);
+				break;
+			}
+
+			/* the stream might have changed */
+			vi = ov_info(&ctx->vf, -1);
+			ctx->format.rate = vi->rate;
+			ctx->format.channels = vi->channels;
+			ctx->pcm_pos = 0;
+			ctx->pcm_len = n;
 		}
-
-		vorbis_info *vi = ov_info(&ctx->vf, -1);
-		format->rate = vi->rate;
-		format->channels = vi->channels;
-
-		return n / sizeof(sample_t);
+		/* one call returns a single format */
+		if (filled && (ctx->format.rate != format->rate ||
+			       ctx->format.channels != format->channels))
+			break;
+		*format = ctx->format;
+
+		unsigned int channels = format->channels;
+		long n = ctx->pcm_len - ctx->pcm_pos;
+		if ((size_t) n > (maxlen - filled) / channels)
+			n = (maxlen - filled) / channels;
+		if (n == 0)
+			break;
+
+		/* interleave */
+		fsample_t *out = &buffer[filled];
+		long i;
+		unsigned int ch;
+		for (ch = 0; ch < channels; ++ch) {
+			const float *src = &ctx->pcm[ch][ctx->pcm_pos];
+			for (i = 0; i < n; ++i)
+				out[i * channels + ch] = src[i];
+		}
+		ctx->pcm_pos += n;
+		filled += n * channels;
 	}
-	return 0;
+	return filled;
 }
 
 static int vorbis_seek(struct input_plugin_ctx *ctx, struct songpos *newpos)
@@ -117,6 +157,7 @@ static int vorbis_seek(struct input_plugin_ctx *ctx, struct songpos *newpos)
 		return -1;
 	}
 	ctx->reliable = (newpos->msecs == 0);
+	ctx->pcm_pos = ctx->pcm_len = 0;
 	return 1;
 }
 
@@ -133,9 +174,10 @@ static struct input_plugin plugin_info = {
 	.detect = vorbis_detect,
 	.open = vorbis_open,
 	.close = vorbis_close,
-	.fillbuf = vorbis_fillbuf,
 	.seek = vorbis_seek,
 	.mime_types = mime_types,
+	.fillbuf_float = vorbis_fillbuf,
+	.fill_buffer = true,
 };
 
 struct input_plugin *get_input_plugin()
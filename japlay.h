@@ -25,9 +25,30 @@ void japlay_play(void);
 void japlay_set_autovol(bool enabled);
 void japlay_seek_relative(long msecs);
 void japlay_seek(long msecs);
+unsigned int japlay_get_play_position(void);
+
+/* Flags returned by japlay_get_realtime() */
+#define REALTIME_PLAY	1 /* play thread uses real-time scheduling */
+#define REALTIME_DECODE	2 /* decode thread uses real-time scheduling */
+#define REALTIME_LOCKED	4 /* audio buffer is locked in memory */
+
+unsigned int japlay_get_realtime(void);
+
+/* Playback problems, for the current song and for the whole session */
+struct japlay_stats {
+	unsigned int underruns; /* the buffer ran empty during a song */
+	unsigned int xruns; /* the device ran out of data */
+	unsigned int late_wakeups; /* the play thread ran late for a write */
+	unsigned int max_stall_msecs; /* longest time between writes */
+};
+
+void japlay_get_stats(struct japlay_stats *song, struct japlay_stats *session);
 void japlay_stop(void);
 void japlay_pause(void);
 void japlay_skip(void);
+void japlay_set_volume(int volume); /* 0 .. 256 */
+void japlay_set_dsp(const char *names);
+void japlay_set_latency(unsigned int period_msecs, unsigned int buffer_msecs);
 
 int japlay_init(int *argc, char **argv);
 void japlay_exit(void);
@@ -0,0 +1,339 @@
+/*
+ * japlay - Just Another Player
+ * Copyright Janne Kulmala 2010
+ */
+#include "loudness.h"
+#include "common.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Integrated loudness as specified by ITU-R BS.1770 and EBU R128. The
+ * K-weighted energy is summed over 100 ms sub-blocks, and each 400 ms
+ * gating block (overlapping by 75%) goes to a histogram of 0.1 LU bins.
+ * The gating only needs the sums, so memory use does not depend on the
+ * length of the song.
+ */
+
+#define ABSOLUTE_GATE	-70.0
+#define RELATIVE_GATE	-10.0
+#define BINS_PER_LU	10
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846
+#endif
+
+/* 4x oversampling interpolation filter, coefficients for each tap are
+   stored next to each other so four phases are computed at once */
+static float peak_coeffs[TRUE_PEAK_TAPS][4];
+
+static double energy_to_lufs(double energy)
+{
+	return -0.691 + 10 * log10(energy);
+}
+
+int setup_loudness(struct loudness_meter *m,
+		   const struct input_format *format)
+{
+	/* 5.1: surround channels are weighted by +1.5 dB, LFE is ignored */
+	static const double surround[6] = {1, 1, 1, 0, 1.41, 1.41};
+	unsigned int ch;
+
+	if (format->channels == 0 ||
+	    format->channels > LOUDNESS_MAX_CHANNELS || format->rate < 8000)
+		return -1;
+
+	memset(m, 0, sizeof(*m));
+	m->rate = format->rate;
+	m->channels = format->channels;
+	for (ch = 0; ch < m->channels; ++ch)
+		m->weight[ch] = m->channels == 6 ? surround[ch] : 1;
+	m->block_len = m->rate / 10;
+
+	/* high shelf, the head */
+	double K = tan(M_PI * 1681.974450955533 / m->rate);
+	double Q = 0.7071752369554196;
+	double Vh = pow(10, 3.999843853973347 / 20);
+	double Vb = pow(Vh, 0.4996667741545416);
+	double a0 = 1 + K / Q + K * K;
+	m->b[0][0] = (Vh + Vb * K / Q + K * K) / a0;
+	m->b[0][1] = 2 * (K * K - Vh) / a0;
+	m->b[0][2] = (Vh - Vb * K / Q + K * K) / a0;
+	m->a[0][1] = 2 * (K * K - 1) / a0;
+	m->a[0][2] = (1 - K / Q + K * K) / a0;
+
+	/* RLB high pass */
+	K = tan(M_PI * 38.13547087602444 / m->rate);
+	Q = 0.5003270373238773;
+	a0 = 1 + K / Q + K * K;
+	m->b[1][0] = 1;
+	m->b[1][1] = -2;
+	m->b[1][2] = 1;
+	m->a[1][1] = 2 * (K * K - 1) / a0;
+	m->a[1][2] = (1 - K / Q + K * K) / a0;
+	return 0;
+}
+
+/* Returns the sum of squares of the K-weighted samples */
+static double filter_channel(struct loudness_meter *m, unsigned int ch,
+			     const fsample_t *buf, size_t frames)
+{
+	double *s0 = m->state[ch][0], *s1 = m->state[ch][1];
+	double z0 = s0[0], z1 = s0[1], z2 = s1[0], z3 = s1[1];
+	double sum = 0;
+	size_t i;
+
+	for (i = 0; i < frames; ++i) {
+		double x = buf[i * m->channels];
+		double y = m->b[0][0] * x + z0;
+		z0 = m->b[0][1] * x - m->a[0][1] * y + z1;
+		z1 = m->b[0][2] * x - m->a[0][2] * y;
+		x = y;
+		y = m->b[1][0] * x + z2;
+		z2 = m->b[1][1] * x - m->a[1][1] * y + z3;
+		z3 = m->b[1][2] * x - m->a[1][2] * y;
+		sum += y * y;
+	}
+	/* avoid denormals during silence */
+	if (fabs(z0) + fabs(z1) + fabs(z2) + fabs(z3) < 1e-20)
+		z0 = z1 = z2 = z3 = 0;
+	s0[0] = z0;
+	s0[1] = z1;
+	s1[0] = z2;
+	s1[1] = z3;
+	return sum;
+}
+
+static void add_block(struct loudness_meter *m, double energy)
+{
+	if (energy <= 0)
+		return;
+	double lufs = energy_to_lufs(energy);
+	if (lufs < ABSOLUTE_GATE)
+		return;
+	int bin = (lufs - ABSOLUTE_GATE) * BINS_PER_LU;
+	if (bin >= LOUDNESS_BINS)
+		bin = LOUDNESS_BINS - 1;
+	m->count[bin]++;
+	m->energy[bin] += energy;
+}
+
+static void measure_energy(struct loudness_meter *m, const fsample_t *buf,
+			   size_t frames)
+{
+	while (frames) {
+		size_t n = m->block_len - m->block_pos;
+		if (n > frames)
+			n = frames;
+		unsigned int ch;
+		for (ch = 0; ch < m->channels; ++ch) {
+			if (m->weight[ch] == 0)
+				continue;
+			m->block_energy += m->weight[ch] *
+				filter_channel(m, ch, &buf[ch], n);
+		}
+		m->block_pos += n;
+		buf += n * m->channels;
+		frames -= n;
+
+		if (m->block_pos == m->block_len) {
+			m->sub[m->sub_cnt % 4] = m->block_energy / m->block_len;
+			m->sub_cnt++;
+			if (m->sub_cnt >= 4)
+				add_block(m, (m->sub[0] + m->sub[1] + m->sub[2] +
+					      m->sub[3]) / 4);
+			m->block_energy = 0;
+			m->block_pos = 0;
+		}
+	}
+}
+
+/* The history keeps the last TRUE_PEAK_TAPS samples twice, so that the
+   newest ones are always consecutive in memory */
+static inline const float *push_history(float *history, unsigned int *pos,
+					float x)
+{
+	history[*pos] = x;
+	history[*pos + TRUE_PEAK_TAPS] = x;
+	if (++*pos == TRUE_PEAK_TAPS)
+		*pos = 0;
+	return &history[*pos];
+}
+
+static float true_peak_c(float *history, unsigned int *pos,
+			 const fsample_t *buf, size_t frames,
+			 unsigned int stride)
+{
+	float peak = 0;
+	size_t i;
+	unsigned int k, p;
+
+	for (i = 0; i < frames; ++i) {
+		const float *w = push_history(history, pos, buf[i * stride]);
+		for (p = 0; p < 4; ++p) {
+			float sum = 0;
+			for (k = 0; k < TRUE_PEAK_TAPS; ++k)
+				sum += w[k] * peak_coeffs[k][p];
+			if (fabsf(sum) > peak)
+				peak = fabsf(sum);
+		}
+	}
+	return peak;
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static float true_peak_sse2(float *history, unsigned int *pos,
+			    const fsample_t *buf, size_t frames,
+			    unsigned int stride)
+{
+	const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 peak = _mm_setzero_ps();
+	__m128 c[TRUE_PEAK_TAPS];
+	size_t i;
+	unsigned int k;
+
+	for (k = 0; k < TRUE_PEAK_TAPS; ++k)
+		c[k] = _mm_loadu_ps(peak_coeffs[k]);
+
+	for (i = 0; i < frames; ++i) {
+		const float *w = push_history(history, pos, buf[i * stride]);
+		__m128 sum0 = _mm_mul_ps(_mm_set1_ps(w[0]), c[0]);
+		__m128 sum1 = _mm_mul_ps(_mm_set1_ps(w[1]), c[1]);
+		for (k = 2; k < TRUE_PEAK_TAPS; k += 2) {
+			sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_set1_ps(w[k]),
+							   c[k]));
+			sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_set1_ps(w[k + 1]),
+							   c[k + 1]));
+		}
+		peak = _mm_max_ps(peak, _mm_and_ps(_mm_add_ps(sum0, sum1),
+						   mask));
+	}
+	peak = _mm_max_ps(peak, _mm_movehl_ps(peak, peak));
+	peak = _mm_max_ss(peak, _mm_shuffle_ps(peak, peak, 1));
+	return _mm_cvtss_f32(peak);
+}
+
+#endif
+
+static float (*true_peak_func)(float *history, unsigned int *pos,
+			       const fsample_t *buf, size_t frames,
+			       unsigned int stride) = true_peak_c;
+
+static void measure_peak(struct loudness_meter *m, const fsample_t *buf,
+			 size_t frames)
+{
+	size_t len = frames * m->channels, i;
+	unsigned int ch, pos = m->history_pos;
+	float sample_peak = 0;
+
+	for (i = 0; i < len; ++i) {
+		if (fabsf(buf[i]) > sample_peak)
+			sample_peak = fabsf(buf[i]);
+	}
+	if (sample_peak > m->peak)
+		m->peak = sample_peak;
+
+	/* Inter-sample peaks of real signals stay well below twice the
+	   sample peak, so the filter can be skipped for the quieter parts.
+	   Only the history needs updating. */
+	size_t skip = 0;
+	if (sample_peak * 2 <= m->peak && frames > TRUE_PEAK_TAPS)
+		skip = frames - TRUE_PEAK_TAPS;
+
+	for (ch = 0; ch < m->channels; ++ch) {
+		pos = m->history_pos;
+		const fsample_t *src = &buf[skip * m->channels + ch];
+		if (skip) {
+			for (i = skip; i < frames; ++i) {
+				push_history(m->history[ch], &pos, *src);
+				src += m->channels;
+			}
+		} else {
+			float peak = true_peak_func(m->history[ch], &pos, src,
+						    frames, m->channels);
+			if (peak > m->peak)
+				m->peak = peak;
+		}
+	}
+	m->history_pos = pos;
+}
+
+/* "len" is in samples and contains whole frames */
+void measure_loudness(struct loudness_meter *m, const fsample_t *buf,
+		      size_t len)
+{
+	size_t frames = len / m->channels;
+	measure_energy(m, buf, frames);
+	measure_peak(m, buf, frames);
+}
+
+float get_loudness(const struct loudness_meter *m)
+{
+	double energy = 0;
+	unsigned int count = 0, i;
+
+	for (i = 0; i < LOUDNESS_BINS; ++i) {
+		energy += m->energy[i];
+		count += m->count[i];
+	}
+	if (count == 0)
+		return ABSOLUTE_GATE - 1;
+
+	double gate = energy_to_lufs(energy / count) + RELATIVE_GATE;
+	int first = ceil((gate - ABSOLUTE_GATE) * BINS_PER_LU);
+	if (first < 0)
+		first = 0;
+
+	energy = 0;
+	count = 0;
+	for (i = first; i < LOUDNESS_BINS; ++i) {
+		energy += m->energy[i];
+		count += m->count[i];
+	}
+	if (count == 0)
+		return ABSOLUTE_GATE - 1;
+	return energy_to_lufs(energy / count);
+}
+
+float get_true_peak(const struct loudness_meter *m)
+{
+	return m->peak;
+}
+
+/* Build the interpolation filter and select the fastest implementation
+   the CPU supports */
+void init_loudness(void)
+{
+	unsigned int k, p;
+	for (p = 0; p < 4; ++p) {
+		double sum = 0;
+		for (k = 0; k < TRUE_PEAK_TAPS; ++k) {
+			/* distance from the output position, in input
+			   samples. Phase zero is the input sample itself. */
+			double t = p / 4.0 + TRUE_PEAK_TAPS / 2 - 1 - k;
+			double x = t / (TRUE_PEAK_TAPS / 2);
+			double h = 1;
+			if (t != 0)
+				h = sin(M_PI * t) / (M_PI * t);
+			/* Lanczos window */
+			if (x != 0)
+				h *= sin(M_PI * x) / (M_PI * x);
+			peak_coeffs[k][p] = h;
+			sum += h;
+		}
+		for (k = 0; k < TRUE_PEAK_TAPS; ++k)
+			peak_coeffs[k][p] /= sum;
+	}
+
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		true_peak_func = true_peak_sse2;
+#endif
+}
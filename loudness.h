@@ -0,0 +1,42 @@
+#ifndef _JAPLAY_LOUDNESS_H_
+#define _JAPLAY_LOUDNESS_H_
+
+#include <string.h> /* size_t */
+#include "plugin.h"
+
+#define LOUDNESS_MAX_CHANNELS	8
+#define LOUDNESS_BINS		1000 /* histogram of block loudness */
+#define TRUE_PEAK_TAPS		12
+
+/* EBU R128 / ITU-R BS.1770 integrated loudness and true peak meter */
+struct loudness_meter {
+	unsigned int rate, channels;
+	double weight[LOUDNESS_MAX_CHANNELS];
+	/* K-weighting filter, two biquads */
+	double b[2][3], a[2][3];
+	double state[LOUDNESS_MAX_CHANNELS][2][2];
+	/* 100 ms sub-blocks, a gating block is four of them */
+	size_t block_len, block_pos;
+	double block_energy, sub[4];
+	unsigned int sub_cnt;
+	unsigned int count[LOUDNESS_BINS];
+	double energy[LOUDNESS_BINS];
+	/* 4x oversampling for the true peak */
+	float history[LOUDNESS_MAX_CHANNELS][2 * TRUE_PEAK_TAPS];
+	unsigned int history_pos;
+	float peak;
+};
+
+int setup_loudness(struct loudness_meter *m,
+		   const struct input_format *format);
+void measure_loudness(struct loudness_meter *m, const fsample_t *buf,
+		      size_t len);
+
+/* Integrated loudness in LUFS, or less than -70 for silence */
+float get_loudness(const struct loudness_meter *m);
+/* True peak, full scale is 1.0 */
+float get_true_peak(const struct loudness_meter *m);
+
+void init_loudness(void);
+
+#endif
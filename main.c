@@ -12,19 +12,49 @@
 #include "config.h"
 #include "buffer.h"
 #include "settings.h"
-
+#include "sample.h"
+#include "resample.h"
+#include "crossfade.h"
+#include "loudness.h"
+#include "command.h"
+
+#include <stdlib.h>
+#include <math.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <dirent.h>
 #include <dlfcn.h>
-#include <ao/ao.h>
 #include <limits.h>
 #include <sys/stat.h>
 #include <pthread.h>
-
-#define REFRESH_RATE	16   /* how often to run the playback loop */
-
-#define TARGET_POWER	64   /* target power for auto adjustment */
+#include <sched.h>
+#include <time.h>
+
+#define DEFAULT_PERIOD_MSECS	62 /* audio written to the output at once */
+#define MAX_PERIOD_MSECS	1000
+#define UI_REFRESH_MSECS	40 /* minimum time between status updates */
+#define SCOPE_HISTORY	0x2000 /* scope samples kept, power of two */
+
+#define DEFAULT_BUFFER_MSECS	340
+#define DEFAULT_LOW_WATERMARK	50 /* percent of the buffer, decoding resumes */
+#define LOW_LATENCY_PERIOD_MSECS	5 /* "latency_profile" low */
+#define LOW_LATENCY_BUFFER_MSECS	20
+#define MAX_BUFFER_MSECS	2000
+#define UNDERRUN_GROW	2    /* underruns before the buffer is grown */
+#define PREOPEN_MSECS	5000 /* open the next stream this long before the end */
+#define STAGE_LEN	0x80000 /* samples decoded from the next song */
+#define STAGE_CHUNKS	64
+#define DEFAULT_SKIP_AHEAD_MSECS	3000
+#define SCRATCH_LEN	0x4000 /* decoded samples waiting for resampling */
+#define DECODE_CHUNK	0x4000 /* samples asked from a plugin at a time */
+#define MAX_CROSSFADE_MSECS	20000
+#define LOUDNESS_TARGET	-18 /* LUFS, for loudness normalization */
+#define LIMITER_HEADROOM	2.0f /* peak level a limiter is trusted with */
+
+#define DEFAULT_OUTPUT	"ao"
+#define DEFAULT_RT_PRIORITY	20
+#define WAKEUP_LOG_SECS	10
 
 int japlay_debug = 0;
 
@@ -34,29 +64,81 @@ static pthread_mutex_t cursor_mutex;
 static pthread_t decode_thread;
 static pthread_mutex_t play_mutex;
 static pthread_cond_t decode_cond;
-static bool playing = false; /* true if we are playing a song */
+static bool decode_sleeping = false;
+static bool playing = false; /* decoding, written by the decode thread */
+static bool paused = false; /* play thread holds the buffered audio */
 
 /* play thread */
 static pthread_cond_t play_cond;
 static pthread_t play_thread;
+static bool play_sleeping = false;
 
 static pthread_t scan_thread;
 static pthread_mutex_t scan_mutex;
 static pthread_cond_t scan_cond;
 static bool scanning = false; /* true if we are scanning the playlist */
 
-static bool reset = false;
+static bool reset = false; /* decode thread only */
+static bool skipped = false; /* the reset is a skip, decode thread only */
 static bool quit = false;
 
+/* Transport control from the UI and other threads, see send_command() */
+static struct command_queue decode_commands, play_commands;
+
 static struct list_head input_plugins;
 static struct list_head playlist_plugins;
+static struct list_head output_plugins;
+static struct list_head dsp_plugins;
 
 static struct playlist_entry *cursor = NULL;
 
-static bool autovol = false;
+static bool autovol = false; /* normalize the loudness of songs */
 static int volume = 256;
+static int loudness_target;
+
+static unsigned int toseek = -1; /* latest seek, decode thread only */
+
+/* The latest seek request, replaced by later ones and taken by the
+   decode thread. The upper half is the number of stops and skips sent
+   before it, a seek is not applied after a later stop or skip. */
+#define SEEK_NONE	((unsigned long long) -1)
+static unsigned long long seek_slot = SEEK_NONE;
+static unsigned int transport_sent = 0; /* stops and skips sent */
+static unsigned int transport_seen = 0; /* handled, decode thread only */
+
+/* threads using real-time scheduling, see the "realtime" setting */
+static unsigned int realtime_mode;
+static bool play_realtime = false, decode_realtime = false;
+static bool buffer_locked = false;
+
+/* buffer length in milliseconds, grows on repeated underruns */
+static unsigned int buffer_msecs, buffer_max_msecs;
+
+/* The decode thread fills the buffer in one go and sleeps until the
+   play thread has drained it below the low watermark */
+static unsigned int low_watermark_percent;
+static size_t low_watermark; /* samples */
+
+/* How often a thread wakes up from sleep_thread(), logged for debugging */
+struct wakeup_count {
+	const char *name;
+	unsigned int count;
+	struct timespec since;
+};
+
+static struct wakeup_count decode_wakeups = {.name = "decode"};
+static struct wakeup_count play_wakeups = {.name = "play"};
+
+/* configured latency, can be changed with japlay_set_latency() */
+static unsigned int period_msecs, base_buffer_msecs;
+static bool buffer_changed = false, period_changed = false;
+
+/* when the last pause or seek was requested, to measure how long it
+   takes until the change is heard */
+static struct timespec command_time;
 
-static unsigned int toseek = -1;
+/* updated by the play thread only */
+static struct japlay_stats song_stats, session_stats;
 
 struct playlist *japlay_queue, *japlay_history;
 
@@ -64,7 +146,8 @@ struct playlist *japlay_queue, *japlay_history;
 #define CURSOR_LOCK pthread_mutex_lock(&cursor_mutex)
 #define CURSOR_UNLOCK pthread_mutex_unlock(&cursor_mutex)
 
-/* Protects "playing" variable, decode_cond, play_cond and ds.buffer */
+/* Protects "playing" variable, decode_cond and play_cond. The audio buffer
+   is lock-free, the lock is only needed to go to sleep and to wake up. */
 #define PLAY_LOCK pthread_mutex_lock(&play_mutex)
 #define PLAY_UNLOCK pthread_mutex_unlock(&play_mutex)
 
@@ -82,22 +165,116 @@ struct playlist_plugin_item {
 	struct playlist_plugin *info;
 };
 
+struct output_plugin_item {
+	struct list_head head;
+	struct output_plugin *info;
+	bool initialized;
+};
+
+/* Audio decoded from the next song in advance, so that skipping to it
+   starts at once. Kept in chunks, the format can change between them. */
+struct stage {
+	fsample_t *data; /* STAGE_LEN samples, kept when the input closes */
+	size_t len, pos; /* samples staged and read */
+	unsigned int chunks, chunk;
+	size_t chunk_pos;
+	struct {
+		size_t len;
+		struct input_format format;
+	} chunk_info[STAGE_CHUNKS];
+	bool full; /* nothing more to stage */
+};
+
+struct dsp_plugin_item {
+	struct list_head head;
+	struct dsp_plugin *info;
+};
+
+/* A plugin in the DSP chain */
+struct dsp_item {
+	struct list_head head;
+	struct dsp_plugin *info;
+	struct dsp_plugin_ctx *ctx;
+	bool active; /* supports the current format */
+};
+
 struct input_state {
-	struct song *song;
+	struct playlist_entry *entry;
+	struct song *song; /* NULL if the song could not be opened */
 	struct input_plugin *plugin;
 	struct input_plugin_ctx *ctx;
-	struct input_format format; /* current audio format */
-	/* decode position in milliseconds */
+	struct input_format format; /* format from the plugin */
+	/* position of the audio taken from the input, in milliseconds */
 	unsigned int position;
 	unsigned int pos_cnt;
-	/* playback position in milliseconds */
-	unsigned int playposition;
-	unsigned int playpos_cnt;
-	unsigned int toseek;
-	struct audio_buffer buffer;
+	/* position of the plugin, ahead of the above while the song is
+	   staged */
+	unsigned int decode_position;
+	unsigned int decode_cnt;
+	unsigned int decode_rate;
+	float gain; /* loudness normalization */
+	struct stage stage;
+	/* DECODE_CHUNK samples for a plugin without fill_buffer, the samples
+	   that came in a new format while filling a chunk wait here */
+	fsample_t *held;
+	size_t held_len, held_pos;
+	struct input_format held_format;
+	bool eof; /* fillbuf has returned 0 */
 };
 
-static struct input_state ds;
+/* The song being decoded, and the next song in the queue, opened in
+   advance to avoid a gap between them. Plugins keep a pointer to their
+   state, so these are swapped and never copied. */
+static struct input_state inputs[2];
+static struct input_state *cur = &inputs[0], *next = &inputs[1];
+
+static struct input_format decode_format; /* format of the written audio */
+static struct audio_buffer audio;
+
+/* Fixed output format, zero fields follow the song. Decoded audio then
+   goes through the scratch buffer and the resampler. */
+static struct input_format output_format;
+static enum resample_quality resample_quality;
+static struct resampler resampler;
+static fsample_t scratch[SCRATCH_LEN];
+static size_t scratch_pos, scratch_len;
+
+/* Crossfade between songs, the decoded chunk waits in fade_chunk until
+   the crossfade buffer takes it */
+static unsigned int crossfade_msecs;
+static struct crossfade fade;
+static fsample_t fade_chunk[SCRATCH_LEN];
+static struct input_format fade_chunk_format;
+static size_t fade_chunk_pos, fade_chunk_len;
+
+/* Start of a song or a seek in the written audio */
+struct play_segment {
+	unsigned long long start; /* in samples */
+	unsigned int position; /* at the start, in milliseconds */
+};
+
+/* The audible playback position. The play thread publishes a snapshot
+   after each write, readers extrapolate from it with the monotonic
+   clock. "seq" is odd while the snapshot is being updated. */
+static struct {
+	unsigned int seq;
+	unsigned int samplerate;
+	unsigned long long written, audible; /* samples since the device
+						was opened */
+	struct timespec time; /* when "audible" was measured */
+	struct play_segment segs[2]; /* previous and latest */
+} play_clock;
+
+/* DSP chain, only used by the decode thread */
+static struct list_head dsp_chain;
+static struct input_format dsp_format;
+static bool dsp_changed = true; /* built when playback first starts */
+static char *dsp_names; /* from japlay_set_dsp(), protected by PLAY_LOCK */
+static bool dsp_limiter = false; /* the chain has a limiter */
+
+/* used by the scan thread */
+static struct loudness_meter loudness_meter;
+static fsample_t analyze_buf[SCRATCH_LEN];
 
 void set_streaming_title(struct song *song, const char *title)
 {
@@ -114,7 +291,7 @@ struct song *get_input_song(struct input_state *state)
 
 unsigned int japlay_get_position(struct input_state *state)
 {
-	return state->position;
+	return state->decode_position;
 }
 
 static struct input_plugin *detect_input_plugin(const char *filename)
@@ -143,6 +320,43 @@ static struct playlist_plugin *detect_playlist_plugin(const char *filename)
 	return NULL;
 }
 
+static struct output_plugin_item *get_output_plugin_item(const char *name)
+{
+	struct list_head *pos;
+	list_for_each(pos, &output_plugins) {
+		struct output_plugin_item *plugin
+			= container_of(pos, struct output_plugin_item, head);
+		if (strcmp(plugin->info->short_name, name) == 0)
+			return plugin;
+	}
+	return NULL;
+}
+
+/* Find the output plugin selected by the "output" setting. Falls back
+   only to a sound device, never to a file or a null sink. */
+static struct output_plugin_item *find_output_plugin(void)
+{
+	static const char *fallbacks[] = {"alsa", "ao", NULL};
+	const char *name = get_setting("output");
+	if (name == NULL)
+		name = DEFAULT_OUTPUT;
+
+	struct output_plugin_item *plugin = get_output_plugin_item(name);
+	if (plugin)
+		return plugin;
+	int i;
+	for (i = 0; fallbacks[i]; ++i) {
+		plugin = get_output_plugin_item(fallbacks[i]);
+		if (plugin) {
+			warning("no output plugin %s, using %s\n", name,
+				fallbacks[i]);
+			return plugin;
+		}
+	}
+	error("no output plugin %s and no sound device plugin\n", name);
+	return NULL;
+}
+
 static void advance_queue_locked(void)
 {
 	/* remove from the queue */
@@ -158,8 +372,8 @@ static void advance_queue_locked(void)
 			put_entry(entry);
 		put_entry(cursor);
 	}
+	/* the play thread updates the UI when the song starts playing */
 	cursor = get_playlist_first(japlay_queue);
-	ui_set_cursor(cursor);
 	reset = true;
 }
 
@@ -170,6 +384,524 @@ static void advance_queue(void)
 	CURSOR_UNLOCK;
 }
 
+static int open_input(struct input_state *in, struct song *song,
+		      struct input_plugin *plugin)
+{
+	in->plugin = plugin;
+	in->gain = 1;
+	in->ctx = calloc(1, plugin->ctx_size);
+	if (in->ctx == NULL)
+		return -1;
+
+	in->song = song;
+	if (plugin->open(in->ctx, in, get_song_filename(song))) {
+		in->song = NULL;
+		free(in->ctx);
+		return -1;
+	}
+	get_song(in->song);
+	/* without the buffer, the chunks are not batched */
+	if (!plugin->fill_buffer)
+		in->held = malloc(DECODE_CHUNK * sizeof(fsample_t));
+	return 0;
+}
+
+/* Gain that brings the song to the target loudness, as far as the peak
+   allows without clipping. A limiter in the DSP chain catches the peaks
+   of quiet songs that are raised a little further. */
+static float song_gain(struct song *song)
+{
+	float loudness, peak;
+	if (!get_song_loudness(song, &loudness, &peak) || loudness < -70)
+		return 1;
+	float gain = powf(10, (loudness_target - loudness) / 20);
+	float max_peak = dsp_limiter ? LIMITER_HEADROOM : 1;
+	if (peak > 0 && gain * peak > max_peak)
+		gain = max_peak / peak;
+	info("%.1f LUFS, gain %.1f dB\n", loudness, 20 * log10f(gain));
+	return gain;
+}
+
+/* Open the song of the given entry. The entry is kept even if the song
+   can not be opened, so that it is not tried again. */
+static int init_input(struct input_state *in, struct playlist_entry *entry)
+{
+	struct song *song = get_entry_song(entry);
+
+	get_entry(entry);
+	in->entry = entry;
+
+	struct input_plugin *plugin =
+		detect_input_plugin(get_song_filename(song));
+	if (plugin == NULL || open_input(in, song, plugin))
+		return -1;
+	if (autovol)
+		in->gain = song_gain(song);
+	return 0;
+}
+
+static void finish_input(struct input_state *in)
+{
+	if (in->song) {
+		in->plugin->close(in->ctx);
+		free(in->ctx);
+		put_song(in->song);
+	}
+	if (in->entry)
+		put_entry(in->entry);
+	free(in->held);
+	fsample_t *stage = in->stage.data;
+	memset(in, 0, sizeof(*in));
+	in->stage.data = stage;
+}
+
+static unsigned long long elapsed_usecs(const struct timespec *since)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000ULL +
+		now.tv_nsec / 1000 - since->tv_nsec / 1000;
+}
+
+static void count_wakeup(struct wakeup_count *w)
+{
+	if (w->since.tv_sec == 0 && w->since.tv_nsec == 0)
+		clock_gettime(CLOCK_MONOTONIC, &w->since);
+	w->count++;
+	unsigned long long usecs = elapsed_usecs(&w->since);
+	if (usecs >= WAKEUP_LOG_SECS * 1000000ULL) {
+		info("%s thread: %.1f wakeups per second\n", w->name,
+		     w->count * 1e6 / usecs);
+		w->count = 0;
+		clock_gettime(CLOCK_MONOTONIC, &w->since);
+	}
+}
+
+/* Sleep until ready() returns true. The sleeping flag lets the other side
+   skip the lock when nobody is waiting, see wake_thread(). */
+static void sleep_thread(pthread_cond_t *cond, bool *sleeping,
+			 bool (*ready)(void), struct wakeup_count *wakeups)
+{
+	bool waited = false;
+	PLAY_LOCK;
+	atomic_write(sleeping, true);
+	memory_barrier();
+	if (!ready()) {
+		pthread_cond_wait(cond, &play_mutex);
+		waited = true;
+	}
+	atomic_write(sleeping, false);
+	PLAY_UNLOCK;
+	if (waited)
+		count_wakeup(wakeups);
+}
+
+static void wake_thread(pthread_cond_t *cond, bool *sleeping)
+{
+	/* pairs with the barrier in sleep_thread() */
+	memory_barrier();
+	if (atomic_read(sleeping)) {
+		PLAY_LOCK;
+		pthread_cond_signal(cond);
+		PLAY_UNLOCK;
+	}
+}
+
+/* Called by the play thread when it has consumed audio */
+static void wake_decoder(void)
+{
+	if (buffer_fill(&audio) <= atomic_read(&low_watermark))
+		wake_thread(&decode_cond, &decode_sleeping);
+}
+
+static int queue_command(struct command_queue *queue,
+			 const struct command *cmd, pthread_cond_t *cond,
+			 bool *sleeping)
+{
+	if (push_command(queue, cmd)) {
+		warning("command queue is full, command dropped\n");
+		return -1;
+	}
+	wake_thread(cond, sleeping);
+	return 0;
+}
+
+/* Pass a command to the threads that act on it. The decode thread
+   handles all but the volume, the play thread all but skipping. Seeks
+   go through seek_slot instead. Returns -1 if the decode thread did not
+   get the command. */
+static int send_command(enum command_type type, long value)
+{
+	struct command cmd = {.type = type, .value = value};
+	int ret = 0;
+	if (type != CMD_VOLUME)
+		ret = queue_command(&decode_commands, &cmd, &decode_cond,
+				    &decode_sleeping);
+	if (type != CMD_SKIP)
+		queue_command(&play_commands, &cmd, &play_cond,
+			      &play_sleeping);
+	return ret;
+}
+
+/* Stop or skip, the seeks requested before it are dropped. The count is
+   taken before the command is queued, so a seek requested meanwhile
+   waits for the command. */
+static void send_transport(enum command_type type)
+{
+	unsigned int sent = atomic_add(&transport_sent, 1);
+	if (send_command(type, sent)) {
+		/* give the count back unless another one was taken, then the
+		   seeks wait for the next stop or skip */
+		atomic_cas(&transport_sent, &sent, sent - 1);
+	}
+}
+
+/* Samples written to the output at once, whole frames */
+static size_t period_samples(const struct input_format *format)
+{
+	size_t period = (size_t) format->rate * format->channels *
+		atomic_read(&period_msecs) / 1000;
+	period -= period % format->channels;
+	if (period < format->channels)
+		period = format->channels;
+	return period;
+}
+
+static void update_buffer_limit(void)
+{
+	unsigned int samplerate = decode_format.rate * decode_format.channels;
+	if (!samplerate)
+		return;
+	set_buffer_limit(&audio, (size_t) buffer_msecs * samplerate / 1000);
+
+	/* the play thread takes a period at once, wake the decoder while
+	   it still has that and one decode round left. Leave room for at
+	   least one decode round above the watermark. */
+	size_t low = audio.limit / 100 * low_watermark_percent;
+	size_t min_low = period_samples(&decode_format) + MIN_FILL;
+	if (low < min_low)
+		low = min_low;
+	if (low + MIN_FILL > audio.limit)
+		low = audio.limit - MIN_FILL;
+	atomic_write(&low_watermark, low);
+}
+
+static void load_latency_settings(void)
+{
+	const char *profile = get_setting("latency_profile");
+	bool low = profile && strcmp(profile, "low") == 0;
+
+	period_msecs = get_setting_int("output_period_msecs",
+		low ? LOW_LATENCY_PERIOD_MSECS : DEFAULT_PERIOD_MSECS);
+	if (period_msecs < 1)
+		period_msecs = 1;
+	if (period_msecs > MAX_PERIOD_MSECS)
+		period_msecs = MAX_PERIOD_MSECS;
+	base_buffer_msecs = get_setting_int("buffer_msecs",
+		low ? LOW_LATENCY_BUFFER_MSECS : DEFAULT_BUFFER_MSECS);
+}
+
+/* Output plugins use this as the default for their own period */
+unsigned int japlay_get_output_period(void)
+{
+	return atomic_read(&period_msecs);
+}
+
+/* Called when playback starts after being idle */
+static void reset_buffer_length(void)
+{
+	buffer_msecs = atomic_read(&base_buffer_msecs);
+	buffer_max_msecs = get_setting_int("buffer_max_msecs",
+					   MAX_BUFFER_MSECS);
+	if (buffer_max_msecs < buffer_msecs)
+		buffer_max_msecs = buffer_msecs;
+	update_buffer_limit();
+}
+
+static void grow_buffer_length(void)
+{
+	if (buffer_msecs >= buffer_max_msecs)
+		return;
+	buffer_msecs += buffer_msecs / 2;
+	if (buffer_msecs > buffer_max_msecs)
+		buffer_msecs = buffer_max_msecs;
+	info("buffer underruns, growing buffer to %u ms\n", buffer_msecs);
+	update_buffer_limit();
+}
+
+/* Called when playback starts after being idle */
+static void load_output_format(void)
+{
+	output_format.rate = get_setting_int("output_rate", 0);
+	output_format.channels = get_setting_int("output_channels", 0);
+	if (output_format.channels > RESAMPLE_MAX_CHANNELS)
+		output_format.channels = RESAMPLE_MAX_CHANNELS;
+	resample_quality = get_setting_int("resample_quality",
+					   RESAMPLE_MEDIUM);
+	low_watermark_percent = get_setting_int("buffer_low_percent",
+						DEFAULT_LOW_WATERMARK);
+	if (low_watermark_percent > 100)
+		low_watermark_percent = 100;
+	crossfade_msecs = get_setting_int("crossfade_msecs", 0);
+	if (crossfade_msecs > MAX_CROSSFADE_MSECS)
+		crossfade_msecs = MAX_CROSSFADE_MSECS;
+	loudness_target = get_setting_int("loudness_target", LOUDNESS_TARGET);
+}
+
+static bool decode_ready(void)
+{
+	return atomic_read(&quit) || command_pending(&decode_commands) ||
+		atomic_read(&seek_slot) != SEEK_NONE ||
+		(playing && ((toseek != (unsigned int) -1 &&
+			      buffer_event_room(&audio)) ||
+		(buffer_fill(&audio) <= atomic_read(&low_watermark) &&
+		 buffer_write_avail(&audio, MIN_FILL) >= MIN_FILL)));
+}
+
+static bool play_ready(void)
+{
+	return atomic_read(&quit) || command_pending(&play_commands) ||
+		(!paused &&
+		(buffer_read_avail(&audio) || get_buffer_event(&audio)));
+}
+
+static void push_event(struct buffer_event *event)
+{
+	if (push_buffer_event(&audio, event) == 0)
+		wake_thread(&play_cond, &play_sleeping);
+	else if (event->entry)
+		put_entry(event->entry);
+}
+
+/* Advance a position in milliseconds with full milliseconds from the
+   sample count */
+static void advance_position(unsigned int *position, unsigned int *cnt,
+			     size_t filled, unsigned int samplerate)
+{
+	*cnt += filled;
+	unsigned int adv = *cnt * 1000 / samplerate;
+	*position += adv;
+	*cnt -= adv * samplerate / 1000;
+}
+
+static size_t call_fillbuf(struct input_state *in, fsample_t *buffer,
+			   size_t maxlen, struct input_format *format)
+{
+	if (in->plugin->fillbuf_float)
+		return in->plugin->fillbuf_float(in->ctx, buffer, maxlen,
+						 format);
+	/* 16-bit plugin, convert in place */
+	size_t filled = in->plugin->fillbuf(in->ctx, (sample_t *) buffer,
+					    maxlen, format);
+	s16_to_float(buffer, (sample_t *) buffer, filled);
+	return filled;
+}
+
+/* Plugins without fill_buffer may return one frame per call. They are
+   called until the chunk is full, so that the buffer is written and the
+   play thread woken once per chunk as with the newer plugins. */
+static size_t fill_chunk(struct input_state *in, fsample_t *buffer,
+			 size_t maxlen, struct input_format *format)
+{
+	if (in->held_pos < in->held_len) {
+		size_t n = in->held_len - in->held_pos;
+		if (n > maxlen)
+			n = maxlen;
+		memcpy(buffer, &in->held[in->held_pos], n * sizeof(fsample_t));
+		in->held_pos += n;
+		*format = in->held_format;
+		return n;
+	}
+	if (in->eof)
+		return 0;
+
+	size_t filled = call_fillbuf(in, buffer, maxlen, format);
+	if (!filled)
+		in->eof = true;
+	while (filled && in->held && maxlen - filled >= MIN_FILL) {
+		struct input_format f;
+		size_t n = call_fillbuf(in, &buffer[filled], maxlen - filled,
+					&f);
+		if (!n) {
+			in->eof = true;
+			break;
+		}
+		if (f.rate != format->rate || f.channels != format->channels) {
+			/* a chunk is in one format */
+			memcpy(in->held, &buffer[filled], n * sizeof(fsample_t));
+			in->held_len = n;
+			in->held_pos = 0;
+			in->held_format = f;
+			break;
+		}
+		filled += n;
+	}
+	return filled;
+}
+
+static size_t decode_input(struct input_state *in, fsample_t *buffer,
+			   size_t maxlen, struct input_format *format)
+{
+	/* plugins that fill the whole buffer would otherwise decode seconds
+	   of audio before the play thread gets any of it */
+	if (maxlen > DECODE_CHUNK)
+		maxlen = DECODE_CHUNK;
+	size_t filled = fill_chunk(in, buffer, maxlen, format);
+	if (!filled)
+		return 0;
+	if (in->gain != 1)
+		scale_samples(buffer, filled, in->gain);
+
+	unsigned int samplerate = format->rate * format->channels;
+	if (in->decode_rate != samplerate) {
+		in->decode_rate = samplerate;
+		in->decode_cnt = 0;
+	}
+	advance_position(&in->decode_position, &in->decode_cnt, filled,
+			 samplerate);
+	return filled;
+}
+
+static size_t read_stage(struct stage *st, fsample_t *buffer, size_t maxlen,
+			 struct input_format *format)
+{
+	if (st->pos == st->len)
+		return 0;
+	size_t n = st->chunk_info[st->chunk].len - st->chunk_pos;
+	if (n > maxlen)
+		n = maxlen;
+	memcpy(buffer, &st->data[st->pos], n * sizeof(fsample_t));
+	*format = st->chunk_info[st->chunk].format;
+	st->pos += n;
+	st->chunk_pos += n;
+	if (st->chunk_pos == st->chunk_info[st->chunk].len) {
+		st->chunk++;
+		st->chunk_pos = 0;
+	}
+	return n;
+}
+
+/* Take the staged audio first, then continue decoding */
+static size_t fill_input(struct input_state *in, fsample_t *buffer,
+			 size_t maxlen, struct input_format *format)
+{
+	size_t filled = read_stage(&in->stage, buffer, maxlen, format);
+	if (!filled)
+		filled = decode_input(in, buffer, maxlen, format);
+	if (!filled)
+		return 0;
+
+	if (in->format.rate != format->rate ||
+	    in->format.channels != format->channels) {
+		in->format = *format;
+		in->pos_cnt = 0;
+	}
+	advance_position(&in->position, &in->pos_cnt, filled,
+			 format->rate * format->channels);
+	return filled;
+}
+
+/* Decode into the scratch buffer and convert to the output format.
+   Returns the number of samples written, which can be zero while the
+   resampler collects input. */
+static size_t fill_resampled(fsample_t *buffer, size_t avail,
+			     struct input_format *format, bool *eof)
+{
+	if (scratch_pos == scratch_len) {
+		struct input_format in;
+		size_t filled = fill_input(cur, scratch, SCRATCH_LEN, &in);
+		if (!filled) {
+			*eof = true;
+			return 0;
+		}
+		scratch_pos = 0;
+		scratch_len = filled;
+
+		struct input_format out = output_format;
+		if (!out.rate)
+			out.rate = in.rate;
+		if (!out.channels)
+			out.channels = in.channels;
+		if (out.channels > RESAMPLE_MAX_CHANNELS)
+			out.channels = RESAMPLE_MAX_CHANNELS;
+		if (in.rate != resampler.in.rate ||
+		    in.channels != resampler.in.channels ||
+		    out.rate != resampler.out.rate ||
+		    out.channels != resampler.out.channels) {
+			if (setup_resampler(&resampler, &in, &out,
+					    resample_quality)) {
+				error("Can not set up resampling\n");
+				*eof = true;
+				return 0;
+			}
+		}
+	}
+
+	size_t inlen = scratch_len - scratch_pos;
+	size_t filled = resample(&resampler, buffer, avail,
+				 &scratch[scratch_pos], &inlen);
+	scratch_pos += inlen;
+	*format = resampler.out;
+	return filled;
+}
+
+/* Decode a chunk in the format of the audio buffer */
+static size_t decode_audio(fsample_t *buffer, size_t maxlen,
+			   struct input_format *format, bool *eof)
+{
+	if (output_format.rate || output_format.channels)
+		return fill_resampled(buffer, maxlen, format, eof);
+	size_t filled = fill_input(cur, buffer, maxlen, format);
+	*eof = !filled;
+	return filled;
+}
+
+/* Decode the whole song to measure its loudness. Streams and songs of
+   unknown length might never end, they are skipped. */
+static void analyze_song(struct song *song, struct input_plugin *plugin)
+{
+	float loudness, peak;
+	if (get_song_loudness(song, &loudness, &peak) ||
+	    get_song_length(song) == (unsigned int) -1 ||
+	    plugin->single_instance)
+		return;
+
+	struct input_state in;
+	memset(&in, 0, sizeof(in));
+	if (open_input(&in, song, plugin)) {
+		finish_input(&in);
+		return;
+	}
+
+	struct loudness_meter *m = &loudness_meter;
+	m->rate = 0;
+	bool complete = false;
+	while (!atomic_read(&quit)) {
+		struct input_format format;
+		size_t filled = fill_input(&in, analyze_buf, SCRATCH_LEN,
+					   &format);
+		if (!filled) {
+			complete = m->rate != 0;
+			break;
+		}
+		if (format.rate != m->rate || format.channels != m->channels) {
+			/* the format can only be set once */
+			if (m->rate || setup_loudness(m, &format))
+				break;
+		}
+		measure_loudness(m, analyze_buf, filled);
+	}
+	finish_input(&in);
+
+	if (complete) {
+		loudness = get_loudness(m);
+		peak = get_true_peak(m);
+		info("%s: %.1f LUFS, true peak %.1f dB\n",
+		     get_song_filename(song), loudness, 20 * log10f(peak));
+		set_song_loudness(song, loudness, peak);
+	}
+}
+
 int get_song_info(struct song *song)
 {
 	const char *filename = get_song_filename(song);
@@ -178,112 +910,568 @@ int get_song_info(struct song *song)
 	if (plugin == NULL)
 		return -1;
 
-	return plugin->scan(song);
+	int ret = plugin->scan(song);
+	if (autovol)
+		analyze_song(song, plugin);
+	return ret;
 }
 
-static int init_input(struct input_state *ds, struct song *song)
+/* Must be called before writing audio in a different format */
+static void set_decode_format(const struct input_format *format)
 {
-	const char *filename = get_song_filename(song);
+	if (decode_format.rate == format->rate &&
+	    decode_format.channels == format->channels)
+		return;
+	info("audio format change: %u Hz, %u channels\n",
+		format->rate, format->channels);
+	decode_format = *format;
+	update_buffer_limit();
+	struct buffer_event event = {.type = EVENT_FORMAT, .format = *format};
+	push_event(&event);
+}
 
-	ds->plugin = detect_input_plugin(filename);
-	if (ds->plugin == NULL)
-		return -1;
+static struct dsp_plugin *find_dsp_plugin(const char *name)
+{
+	struct list_head *pos;
+	list_for_each(pos, &dsp_plugins) {
+		struct dsp_plugin_item *plugin
+			= container_of(pos, struct dsp_plugin_item, head);
+		if (strcmp(plugin->info->short_name, name) == 0)
+			return plugin->info;
+	}
+	warning("no DSP plugin %s\n", name);
+	return NULL;
+}
 
-	ds->ctx = calloc(1, ds->plugin->ctx_size);
-	if (ds->ctx == NULL)
-		return -1;
+static void clear_dsp_chain(void)
+{
+	while (!list_empty(&dsp_chain)) {
+		struct dsp_item *item
+			= container_of(dsp_chain.next, struct dsp_item, head);
+		if (item->info->close)
+			item->info->close(item->ctx);
+		list_del(&item->head);
+		free(item->ctx);
+		free(item);
+	}
+	dsp_limiter = false;
+}
+
+/* Build the chain from the "dsp" setting, a comma separated list of
+   plugin names */
+static void load_dsp_chain(void)
+{
+	clear_dsp_chain();
+	memset(&dsp_format, 0, sizeof(dsp_format));
+
+	PLAY_LOCK;
+	const char *setting = dsp_names ? dsp_names : get_setting("dsp");
+	char *names = setting ? strdup(setting) : NULL;
+	PLAY_UNLOCK;
+	if (names == NULL)
+		return;
+
+	char *saveptr, *name;
+	for (name = strtok_r(names, ", ", &saveptr); name;
+	     name = strtok_r(NULL, ", ", &saveptr)) {
+		struct dsp_plugin *plugin = find_dsp_plugin(name);
+		if (plugin == NULL)
+			continue;
+		struct dsp_item *item = NEW(struct dsp_item);
+		if (item == NULL)
+			break;
+		item->info = plugin;
+		item->ctx = calloc(1, plugin->ctx_size);
+		if (item->ctx == NULL) {
+			free(item);
+			break;
+		}
+		list_add_tail(&item->head, &dsp_chain);
+		if (plugin->limiter)
+			dsp_limiter = true;
+		info("DSP: %s\n", plugin->name);
+	}
+	free(names);
+}
+
+static void reset_dsp_chain(void)
+{
+	struct list_head *pos;
+	list_for_each(pos, &dsp_chain) {
+		struct dsp_item *item = container_of(pos, struct dsp_item, head);
+		if (item->active && item->info->reset)
+			item->info->reset(item->ctx);
+	}
+}
+
+/* Run the plugins from pos to the end of the chain. Returns the length
+   of the processed audio, plugins that delay it can shorten it. */
+static size_t run_dsp_items(struct list_head *pos, fsample_t *buffer,
+			    size_t len)
+{
+	for (; pos != &dsp_chain && len; pos = pos->next) {
+		struct dsp_item *item = container_of(pos, struct dsp_item, head);
+		if (!item->active)
+			continue;
+		if (item->info->process_delayed)
+			len = item->info->process_delayed(item->ctx, buffer,
+							  len);
+		else
+			item->info->process(item->ctx, buffer, len);
+	}
+	return len;
+}
+
+/* Process the audio before it goes to the audio buffer. Returns the
+   length of the processed audio. */
+static size_t run_dsp_chain(fsample_t *buffer, size_t len,
+			    const struct input_format *format)
+{
+	struct list_head *pos;
+	if (list_empty(&dsp_chain) || len == 0)
+		return len;
+
+	if (format->rate != dsp_format.rate ||
+	    format->channels != dsp_format.channels) {
+		dsp_format = *format;
+		list_for_each(pos, &dsp_chain) {
+			struct dsp_item *item
+				= container_of(pos, struct dsp_item, head);
+			item->active =
+				item->info->configure(item->ctx, format) == 0;
+			if (!item->active)
+				warning("DSP %s does not support %u Hz, %u channels\n",
+					item->info->name, format->rate,
+					format->channels);
+		}
+	}
+
+	return run_dsp_items(dsp_chain.next, buffer, len);
+}
+
+/* Write out the audio the plugins still hold at the end of the queue.
+   Returns false when nothing is left. */
+static bool drain_dsp_chain(fsample_t *buffer, size_t maxlen, size_t *len)
+{
+	struct list_head *pos;
+	list_for_each(pos, &dsp_chain) {
+		struct dsp_item *item = container_of(pos, struct dsp_item, head);
+		if (!item->active || !item->info->drain)
+			continue;
+		size_t n = item->info->drain(item->ctx, buffer, maxlen);
+		if (n) {
+			/* through the rest of the chain */
+			*len = run_dsp_items(pos->next, buffer, n);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool crossfading(void)
+{
+	return crossfade_msecs || !crossfade_empty(&fade) ||
+		fade_chunk_pos != fade_chunk_len;
+}
+
+/* Move the audio that will not be mixed anymore to the audio buffer */
+static size_t write_crossfade(size_t avail)
+{
+	size_t len = crossfade_read(&fade, write_buffer(&audio), avail);
+	if (len) {
+		size_t out = run_dsp_chain(write_buffer(&audio), len,
+					   &fade.format);
+		buffer_written(&audio, out);
+		wake_thread(&play_cond, &play_sleeping);
+	}
+	return len;
+}
+
+/* Decode through the crossfade buffer. Returns false at the end of the
+   song. */
+static bool fill_crossfade(size_t avail)
+{
+	if (write_crossfade(avail))
+		return true;
+
+	if (fade_chunk_pos == fade_chunk_len) {
+		bool eof = false;
+		fade_chunk_len = decode_audio(fade_chunk, SCRATCH_LEN,
+					      &fade_chunk_format, &eof);
+		fade_chunk_pos = 0;
+		if (eof)
+			return false;
+	}
+	if (fade_chunk_pos == fade_chunk_len)
+		return true;
+
+	if (fade_chunk_format.rate != fade.format.rate ||
+	    fade_chunk_format.channels != fade.format.channels ||
+	    crossfade_msecs != fade.msecs) {
+		if (!crossfade_empty(&fade)) {
+			/* play out the held audio before the format changes */
+			crossfade_finish(&fade);
+			return true;
+		}
+		if (setup_crossfade(&fade, &fade_chunk_format, crossfade_msecs,
+				    SCRATCH_LEN)) {
+			error("Can not allocate crossfade buffer\n");
+			return false;
+		}
+		set_decode_format(&fade_chunk_format);
+	}
+	fade_chunk_pos += crossfade_write(&fade, &fade_chunk[fade_chunk_pos],
+					  fade_chunk_len - fade_chunk_pos);
+	return true;
+}
 
-	ds->song = song;
-	if (ds->plugin->open(ds->ctx, ds, filename)) {
-		ds->song = NULL;
-		free(ds->ctx);
+/* Forget the decoded audio that has not been written to the buffer */
+static void drop_decoded(void)
+{
+	scratch_pos = 0;
+	scratch_len = 0;
+	reset_resampler(&resampler);
+	fade_chunk_pos = 0;
+	fade_chunk_len = 0;
+	crossfade_flush(&fade);
+	reset_dsp_chain();
+}
+
+/* Start decoding the song at the cursor. Returns -1 if playback should
+   stop. */
+static int start_input(void)
+{
+	CURSOR_LOCK;
+	struct playlist_entry *entry = cursor;
+	if (entry)
+		get_entry(entry);
+	CURSOR_UNLOCK;
+
+	struct buffer_event event = {.type = EVENT_SONG, .position = 0,
+		.entry = entry};
+	if (entry == NULL) {
+		/* the queue has ran out */
+		finish_input(next);
+		push_event(&event);
 		return -1;
 	}
-	get_song(ds->song);
+
+	if (next->entry == entry && next->song) {
+		/* already opened, continue without a gap */
+		struct input_state *tmp = cur;
+		cur = next;
+		next = tmp;
+	} else {
+		finish_input(next);
+		if (init_input(cur, entry)) {
+			char *msg = concat_strings("Unable to play file ",
+				get_song_filename(get_entry_song(entry)));
+			if (msg) {
+				ui_show_message(msg);
+				free(msg);
+			}
+			finish_input(cur);
+			put_entry(entry);
+			return -1;
+		}
+	}
+	push_event(&event);
 	return 0;
 }
 
-static void finish_input(struct input_state *ds)
+/* Keep the next song in the queue open. Streams are opened only near
+   the end of the current song, so that the connection does not sit
+   idle. */
+static void open_next_input(void)
+{
+	CURSOR_LOCK;
+	struct playlist_entry *entry = NULL;
+	if (cursor)
+		entry = get_playlist_next(japlay_queue, cursor);
+	CURSOR_UNLOCK;
+	if (entry == next->entry) {
+		/* already opened or tried */
+		if (entry)
+			put_entry(entry);
+		return;
+	}
+	/* the queue has changed */
+	finish_input(next);
+	if (entry == NULL)
+		return;
+
+	const char *filename = get_song_filename(get_entry_song(entry));
+	unsigned int length = get_song_length(cur->song);
+	if (strstr(filename, "://") && (length == (unsigned int) -1 ||
+	    cur->position + PREOPEN_MSECS < length)) {
+		put_entry(entry);
+		return;
+	}
+
+	struct input_plugin *plugin = detect_input_plugin(filename);
+	if (plugin && plugin == cur->plugin && plugin->single_instance) {
+		/* can not have two files open, open at the end */
+		get_entry(entry);
+		next->entry = entry;
+	} else {
+		info("opening the next song in advance\n");
+		init_input(next, entry);
+	}
+	put_entry(entry);
+}
+
+/* Decode the start of the next song while the buffer is full. Returns
+   false if there is nothing to do. */
+static bool stage_next_input(void)
+{
+	struct stage *st = &next->stage;
+	if (next->song == NULL || st->full)
+		return false;
+	if (st->data == NULL) {
+		st->data = malloc(STAGE_LEN * sizeof(fsample_t));
+		if (st->data == NULL) {
+			st->full = true;
+			return false;
+		}
+	}
+
+	struct input_format format;
+	size_t filled = decode_input(next, &st->data[st->len],
+				     STAGE_LEN - st->len, &format);
+	if (!filled) {
+		st->full = true;
+		return false;
+	}
+	st->chunk_info[st->chunks].len = filled;
+	st->chunk_info[st->chunks].format = format;
+	st->chunks++;
+	st->len += filled;
+
+	size_t limit = (size_t) get_setting_int("skip_ahead_msecs",
+						DEFAULT_SKIP_AHEAD_MSECS) *
+		format.rate / 1000 * format.channels;
+	if (st->len >= limit || STAGE_LEN - st->len < MIN_FILL ||
+	    st->chunks == STAGE_CHUNKS) {
+		info("%zu ms of the next song decoded in advance\n",
+		     st->len * 1000 / (format.rate * format.channels));
+		st->full = true;
+	}
+	return true;
+}
+
+/* Switch the calling thread to real-time scheduling. Without the
+   permission, the thread stays at the normal priority. */
+static bool set_realtime(const char *name, int priority)
+{
+	const char *policy_name = get_setting("realtime_policy");
+	int policy = SCHED_FIFO;
+	if (policy_name && strcmp(policy_name, "rr") == 0)
+		policy = SCHED_RR;
+
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+	if (param.sched_priority < sched_get_priority_min(policy))
+		param.sched_priority = sched_get_priority_min(policy);
+	if (param.sched_priority > sched_get_priority_max(policy))
+		param.sched_priority = sched_get_priority_max(policy);
+
+	int err = pthread_setschedparam(pthread_self(), policy, &param);
+	if (err) {
+		warning("unable to use real-time scheduling for the %s thread (%s)\n",
+			name, strerror(err));
+		return false;
+	}
+	info("%s thread: %s, priority %d\n", name,
+	     policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO",
+	     param.sched_priority);
+	return true;
+}
+
+/* Returns REALTIME_* flags of what is in effect */
+unsigned int japlay_get_realtime(void)
 {
-	ds->plugin->close(ds->ctx);
-	free(ds->ctx);
-	put_song(ds->song);
+	unsigned int flags = 0;
+	if (atomic_read(&play_realtime))
+		flags |= REALTIME_PLAY;
+	if (atomic_read(&decode_realtime))
+		flags |= REALTIME_DECODE;
+	if (buffer_locked)
+		flags |= REALTIME_LOCKED;
+	return flags;
+}
+
+/* Commands from several threads can be queued out of order */
+static void see_transport(unsigned int sent)
+{
+	if ((int) (sent - transport_seen) > 0)
+		transport_seen = sent;
+}
+
+/* Take the latest seek, unless it follows a stop or skip that is still
+   in the queue */
+static void take_seek(void)
+{
+	unsigned long long slot = atomic_read(&seek_slot);
+	while (slot != SEEK_NONE) {
+		unsigned int sent = slot >> 32;
+		if ((int) (sent - transport_seen) > 0)
+			return;
+		if (atomic_cas(&seek_slot, &slot, SEEK_NONE)) {
+			if (sent != transport_seen)
+				return;
+			if (toseek != (unsigned int) -1)
+				info("seek to %u ms replaced\n", toseek);
+			toseek = slot;
+			return;
+		}
+	}
+}
+
+/* Apply the transport commands sent to the decode thread. Only the
+   latest of several queued seeks is carried out. */
+static void run_decode_commands(void)
+{
+	struct command cmd;
+	while (pop_command(&decode_commands, &cmd)) {
+		switch (cmd.type) {
+		case CMD_PLAY:
+			CURSOR_LOCK;
+			if (cursor == NULL)
+				advance_queue_locked();
+			CURSOR_UNLOCK;
+			atomic_write(&playing, true);
+			break;
+		case CMD_PAUSE:
+			atomic_write(&playing, false);
+			break;
+		case CMD_STOP:
+			reset = true;
+			toseek = -1;
+			see_transport(cmd.value);
+			atomic_write(&playing, false);
+			break;
+		case CMD_SKIP:
+			/* a seek before the skip was meant for the old song */
+			toseek = -1;
+			see_transport(cmd.value);
+			skipped = true;
+			advance_queue();
+			break;
+		default:
+			break;
+		}
+	}
+	take_seek();
 }
 
 static void *decode_thread_routine(void *arg)
 {
 	UNUSED(arg);
 
-	while (!quit) {
+	/* below the play thread, which must never wait for decoding */
+	if (realtime_mode >= 2)
+		atomic_write(&decode_realtime,
+			     set_realtime("decode",
+					  get_setting_int("realtime_priority",
+							  DEFAULT_RT_PRIORITY) - 1));
+
+	bool idle = true;
+	bool ended = false; /* the song played to the end */
+	bool stopping = false; /* the queue has ran out */
+	unsigned int seen_underruns = 0;
+
+	while (!atomic_read(&quit)) {
+		run_decode_commands();
+
 		if (reset) {
 			/* close the current song file */
 			reset = false;
-			if (ds.song) {
-				finish_input(&ds);
-				ds.song = NULL;
-				ds.position = 0;
-				ds.pos_cnt = 0;
+			finish_input(cur);
+			if (ended)
+				crossfade_start(&fade);
+			else {
+				/* skipped, the next song starts at once, also
+				   when paused. A stop plays out the buffer. */
+				if (skipped)
+					flush_buffer(&audio);
+				drop_decoded();
 			}
+			ended = false;
+			skipped = false;
+			stopping = false;
 		}
 
-		size_t avail;
-
-		PLAY_LOCK;
-		if (!playing) {
-			/* we are not currently playing, sleep */
-			pthread_cond_wait(&decode_cond, &play_mutex);
-			PLAY_UNLOCK;
-			continue;
-		} else {
-			avail = buffer_write_avail(&ds.buffer, MIN_FILL);
-			if (avail < MIN_FILL) {
-				/* buffer is full, wake up play thread and sleep */
-				pthread_cond_signal(&play_cond);
-				pthread_cond_wait(&decode_cond, &play_mutex);
-				PLAY_UNLOCK;
-				continue;
+		size_t avail = 0;
+		if (playing)
+			avail = buffer_write_avail(&audio, MIN_FILL);
+		/* a seek waits for room in the event queue too */
+		if (avail < MIN_FILL &&
+		    (!playing || toseek == (unsigned int) -1 ||
+		     !buffer_event_room(&audio))) {
+			/* the buffer is full, prepare the next song */
+			if (playing && cur->song && !reset) {
+				open_next_input();
+				if (stage_next_input())
+					continue;
 			}
+			/* not playing or buffer is full, sleep */
+			if (!playing)
+				idle = true;
+			sleep_thread(&decode_cond, &decode_sleeping,
+				     decode_ready, &decode_wakeups);
+			continue;
 		}
-		PLAY_UNLOCK;
 
-		/* avail >= MIN_FILL and playing == true */
+		if (idle) {
+			/* shrink the buffer back after being idle */
+			idle = false;
+			load_output_format();
+			reset_buffer_length();
+			seen_underruns = atomic_read(&session_stats.underruns);
+		} else if (atomic_read(&session_stats.underruns) -
+			   seen_underruns >= UNDERRUN_GROW) {
+			seen_underruns = atomic_read(&session_stats.underruns);
+			grow_buffer_length();
+		}
+		if (atomic_read(&dsp_changed)) {
+			atomic_write(&dsp_changed, false);
+			load_dsp_chain();
+		}
+		if (atomic_read(&buffer_changed)) {
+			atomic_write(&buffer_changed, false);
+			reset_buffer_length();
+		}
 
-		CURSOR_LOCK;
-		if (ds.song == NULL) {
-			/* start a new song */
-			struct song *song = NULL;
-			if (cursor) {
-				song = get_entry_song(cursor);
-				get_song(song);
-			}
-			CURSOR_UNLOCK;
-			if (song == NULL) {
-				playing = false;
-				continue;
-			}
+		/* avail >= MIN_FILL or a seek is pending and the event queue
+		   has room, and playing == true */
 
-			if (init_input(&ds, song)) {
-				char *msg = concat_strings("Unable to play file ",
-					get_song_filename(song));
-				if (msg) {
-					ui_show_message(msg);
-					free(msg);
+		if (cur->song == NULL) {
+			if (!stopping && start_input()) {
+				/* play out the held audio before stopping */
+				crossfade_finish(&fade);
+				stopping = true;
+			}
+			if (stopping) {
+				size_t len;
+				if (!crossfade_empty(&fade))
+					write_crossfade(avail);
+				else if (drain_dsp_chain(write_buffer(&audio),
+							 avail, &len)) {
+					buffer_written(&audio, len);
+					wake_thread(&play_cond, &play_sleeping);
+				} else {
+					stopping = false;
+					atomic_write(&playing, false);
 				}
-				put_song(song);
-				playing = false;
 				continue;
 			}
-			ds.toseek = 0;
-			mark_buffer_event(&ds.buffer);
-			put_song(song);
 		}
-		else
-			CURSOR_UNLOCK;
 
 		if (toseek != (unsigned int) -1) {
 			struct songpos newpos = {.msecs = toseek,};
 			toseek = -1;
-			int seekret = ds.plugin->seek(ds.ctx, &newpos);
+			int seekret = cur->plugin->seek(cur->ctx, &newpos);
 			if (seekret < 0) {
 				error("Seek error\n");
 				goto diediedie;
@@ -291,174 +1479,592 @@ static void *decode_thread_routine(void *arg)
 				warning("Seek not supported\n");
 			} else {
 				info("Seeking to %ld.%.1lds\n", newpos.msecs / 1000, (newpos.msecs % 1000) / 100);
-				ds.position = newpos.msecs;
-				ds.pos_cnt = 0;
-				ds.toseek = newpos.msecs;
-				mark_buffer_event(&ds.buffer);
+				cur->position = newpos.msecs;
+				cur->pos_cnt = 0;
+				cur->decode_position = newpos.msecs;
+				cur->decode_cnt = 0;
+				/* the staged and held audio is from before */
+				cur->stage.pos = cur->stage.len;
+				cur->held_pos = cur->held_len;
+				cur->eof = false;
+				/* drop the audio buffered before the seek */
+				flush_buffer(&audio);
+				drop_decoded();
+				struct buffer_event event = {.type = EVENT_SEEK,
+					.position = newpos.msecs};
+				push_event(&event);
 			}
-			/* FIXME: clear audio buffer
-			PLAY_LOCK;
-			init_buffer(&ds.buffer);
-			PLAY_UNLOCK;*/
 		}
 
-		struct input_format format;
-		size_t filled = ds.plugin->fillbuf(ds.ctx,
-			write_buffer(&ds.buffer), avail, &format);
-		if (!filled) {
+		if (avail < MIN_FILL) {
+			/* wait until the play thread drops the stale audio */
+			continue;
+		}
+
+		bool eof = false;
+		if (crossfading())
+			eof = !fill_crossfade(avail);
+		else {
+			struct input_format format;
+			size_t filled = decode_audio(write_buffer(&audio), avail,
+						     &format, &eof);
+			if (filled) {
+				set_decode_format(&format);
+				filled = run_dsp_chain(write_buffer(&audio),
+						       filled, &format);
+				buffer_written(&audio, filled);
+				wake_thread(&play_cond, &play_sleeping);
+			}
+		}
+		if (eof) {
 		diediedie:
+			ended = true;
 			advance_queue();
 			continue;
 		}
 
-		/* check for format changes */
-		if (ds.format.rate != format.rate ||
-		    ds.format.channels != format.channels) {
-			info("audio format change: %u Hz, %u channels\n",
-				format.rate, format.channels);
-			ds.pos_cnt = 0;
-			ds.format = format;
-			mark_buffer_event(&ds.buffer);
-		}
+		open_next_input();
+	}
 
-		PLAY_LOCK;
-		buffer_written(&ds.buffer, filled);
-		PLAY_UNLOCK;
+	finish_input(cur);
+	finish_input(next);
+	clear_dsp_chain();
+	free(cur->stage.data);
+	free(next->stage.data);
+	return NULL;
+}
 
-		ds.pos_cnt += filled;
+static struct output_plugin_ctx *open_output(struct output_plugin **plugin,
+					     const struct input_format *format)
+{
+	struct output_plugin_item *item = find_output_plugin();
+	if (item == NULL)
+		return NULL;
 
-		/* advance song position with full milliseconds from pos_cnt */
-		unsigned int samplerate = ds.format.rate * ds.format.channels;
-		unsigned int adv = ds.pos_cnt * 1000 / samplerate;
-		ds.position += adv;
-		ds.pos_cnt -= adv * samplerate / 1000;
+	if (!item->initialized) {
+		if (item->info->init && item->info->init())
+			return NULL;
+		item->initialized = true;
 	}
 
-	if (ds.song)
-		finish_input(&ds);
-	return NULL;
+	struct output_plugin_ctx *ctx = calloc(1, item->info->ctx_size);
+	if (ctx == NULL)
+		return NULL;
+
+	info("open audio output %s: %u Hz, %u channels\n",
+	     item->info->short_name, format->rate, format->channels);
+	if (item->info->open(ctx, format)) {
+		free(ctx);
+		return NULL;
+	}
+	*plugin = item->info;
+	return ctx;
+}
+
+static void close_output(struct output_plugin *plugin,
+			 struct output_plugin_ctx *ctx)
+{
+	plugin->close(ctx);
+	free(ctx);
+}
+
+static void begin_clock_update(void)
+{
+	atomic_write(&play_clock.seq, play_clock.seq + 1);
+	memory_barrier();
+}
+
+static void end_clock_update(void)
+{
+	memory_barrier();
+	atomic_write(&play_clock.seq, play_clock.seq + 1);
+}
+
+/* A song starts or a seek was made at the current write position */
+static void clock_segment(unsigned int position)
+{
+	begin_clock_update();
+	play_clock.segs[0] = play_clock.segs[1];
+	play_clock.segs[1].start = play_clock.written;
+	play_clock.segs[1].position = position;
+	end_clock_update();
+}
+
+/* The device was closed after playing everything written to it */
+static void clock_drained(void)
+{
+	struct play_segment *seg = &play_clock.segs[1];
+	unsigned int position = seg->position;
+	if (play_clock.samplerate && play_clock.written > seg->start)
+		position += (play_clock.written - seg->start) * 1000 /
+			play_clock.samplerate;
+
+	begin_clock_update();
+	play_clock.written = 0;
+	play_clock.audible = 0;
+	play_clock.segs[0].start = 0;
+	play_clock.segs[0].position = position;
+	play_clock.segs[1] = play_clock.segs[0];
+	end_clock_update();
+}
+
+static void clock_opened(unsigned int samplerate)
+{
+	begin_clock_update();
+	play_clock.samplerate = samplerate;
+	end_clock_update();
+}
+
+static void clock_written(size_t len, size_t delay)
+{
+	begin_clock_update();
+	play_clock.written += len;
+	play_clock.audible = play_clock.written;
+	if (delay < play_clock.audible)
+		play_clock.audible -= delay;
+	else
+		play_clock.audible = 0;
+	clock_gettime(CLOCK_MONOTONIC, &play_clock.time);
+	end_clock_update();
+}
+
+/* Returns the number of samples written that are audible now, and the
+   segment they belong to */
+static unsigned long long read_clock(struct play_segment *seg,
+				     unsigned int *samplerate)
+{
+	unsigned int seq;
+	unsigned long long written, audible;
+	struct timespec time;
+	do {
+		seq = atomic_read(&play_clock.seq);
+		*samplerate = play_clock.samplerate;
+		written = play_clock.written;
+		audible = play_clock.audible;
+		time = play_clock.time;
+		if (audible >= play_clock.segs[1].start)
+			*seg = play_clock.segs[1];
+		else
+			*seg = play_clock.segs[0];
+		memory_barrier();
+	} while ((seq & 1) || seq != atomic_read(&play_clock.seq));
+
+	if (audible < written) {
+		/* the device keeps playing after the snapshot */
+		audible += elapsed_usecs(&time) * *samplerate / 1000000;
+		if (audible > written)
+			audible = written;
+	}
+	return audible;
+}
+
+/* Position of the audio that is heard right now, in milliseconds */
+unsigned int japlay_get_play_position(void)
+{
+	struct play_segment seg;
+	unsigned int samplerate;
+	unsigned long long audible = read_clock(&seg, &samplerate);
+	if (samplerate == 0 || audible < seg.start)
+		return seg.position;
+	return seg.position + (audible - seg.start) * 1000 / samplerate;
+}
+
+/* Number of samples queued in the device, "latency" is used if the
+   output can not tell */
+static size_t output_delay(struct output_plugin *output,
+			   struct output_plugin_ctx *dev, size_t latency)
+{
+	size_t delay;
+	if (output->delay && output->delay(dev, &delay) == 0)
+		return delay;
+	return latency;
+}
+
+static void record_stats(unsigned int underruns, unsigned int xruns,
+			 unsigned int late_wakeups, unsigned int stall_msecs)
+{
+	struct japlay_stats *stats[2] = {&song_stats, &session_stats};
+	unsigned int i;
+	for (i = 0; i < 2; ++i) {
+		struct japlay_stats *s = stats[i];
+		atomic_write(&s->underruns, s->underruns + underruns);
+		atomic_write(&s->xruns, s->xruns + xruns);
+		atomic_write(&s->late_wakeups, s->late_wakeups + late_wakeups);
+		if (stall_msecs > s->max_stall_msecs)
+			atomic_write(&s->max_stall_msecs, stall_msecs);
+	}
+}
+
+static void log_stats(const char *what, const struct japlay_stats *s)
+{
+	info("%s: %u underruns, %u xruns, %u late wakeups, longest stall %u ms\n",
+	     what, s->underruns, s->xruns, s->late_wakeups,
+	     s->max_stall_msecs);
+}
+
+/* Either pointer can be NULL. The fields are read one by one, so they
+   can be from slightly different moments. */
+void japlay_get_stats(struct japlay_stats *song, struct japlay_stats *session)
+{
+	struct japlay_stats *dst[2] = {song, session};
+	const struct japlay_stats *src[2] = {&song_stats, &session_stats};
+	unsigned int i;
+	for (i = 0; i < 2; ++i) {
+		if (dst[i] == NULL)
+			continue;
+		dst[i]->underruns = atomic_read(&src[i]->underruns);
+		dst[i]->xruns = atomic_read(&src[i]->xruns);
+		dst[i]->late_wakeups = atomic_read(&src[i]->late_wakeups);
+		dst[i]->max_stall_msecs = atomic_read(&src[i]->max_stall_msecs);
+	}
+}
+
+/* Milliseconds from the last command until "delay" samples queued in the
+   device have been played */
+static unsigned int command_latency(size_t delay, unsigned int samplerate)
+{
+	return elapsed_usecs(&command_time) / 1000 +
+		(unsigned long long) delay * 1000 / samplerate;
+}
+
+static void run_play_commands(void)
+{
+	struct command cmd;
+	while (pop_command(&play_commands, &cmd)) {
+		switch (cmd.type) {
+		case CMD_PLAY:
+		case CMD_STOP:
+			/* stopping plays out the held audio */
+			paused = false;
+			break;
+		case CMD_PAUSE:
+			paused = true;
+			break;
+		case CMD_VOLUME:
+			volume = cmd.value;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Show the song in the UI when it is heard */
+static void show_cursor(struct playlist_entry **pending, bool *has_pending)
+{
+	if (!*has_pending)
+		return;
+	ui_set_cursor(*pending);
+	if (*pending)
+		put_entry(*pending);
+	*pending = NULL;
+	*has_pending = false;
 }
 
 static void *play_thread_routine(void *arg)
 {
 	UNUSED(arg);
 
-	ao_device *dev = NULL;
-	ao_sample_format format = {.bits = 16, .byte_format = AO_FMT_NATIVE,
-			.rate = 0, .channels = 0};
-	unsigned int power_cnt = 0, power = 0;
-	int scope[SCOPE_SIZE];
+	struct output_plugin *output = NULL;
+	struct output_plugin_ctx *dev = NULL;
+	struct input_format format = {.rate = 0, .channels = 0};
+	unsigned int status_cnt = 0;
+	struct level_meter meter;
+	int scope[SCOPE_SIZE] = {0};
+	static int scope_history[SCOPE_HISTORY];
+	/* converted audio for plugins without get_buffer, a period long */
+	sample_t *output_buf = NULL;
+	size_t output_len = 0;
+	size_t latency = 0;
+	bool played = false;
+	/* end of the previous write, to find late wakeups and stalls */
+	struct timespec last_write;
+	bool timing = false;
+	size_t last_len = 0;
+	unsigned int xruns = 0; /* reported by the device since open */
+	bool holding = false; /* paused */
+	bool dev_paused = false; /* the device was paused too */
+	/* the device was let run out of data, ignore the xrun */
+	bool ran_dry = false;
+	bool seeked = false; /* measure the seek latency on the next write */
+	/* the song starting, shown in the UI when it becomes audible */
+	struct playlist_entry *pending = NULL;
+	bool has_pending = false;
+
+	if (realtime_mode >= 1)
+		atomic_write(&play_realtime,
+			     set_realtime("play",
+					  get_setting_int("realtime_priority",
+							  DEFAULT_RT_PRIORITY)));
+
+	reset_meter(&meter, 0);
+
+	while (!atomic_read(&quit)) {
+		run_play_commands();
+
+		if (paused) {
+			if (!holding && dev) {
+				if (format.rate)
+					info("pause heard after %u ms\n",
+					     command_latency(output_delay(output,
+							dev, latency),
+						format.rate * format.channels));
+				dev_paused = output->pause &&
+					output->pause(dev, true) == 0;
+			}
+			holding = true;
+			timing = false;
+			sleep_thread(&play_cond, &play_sleeping, play_ready,
+				     &play_wakeups);
+			continue;
+		}
+		if (holding && dev) {
+			if (!dev_paused) {
+				/* the device ran out of data during the pause,
+				   that is not an underrun */
+				ran_dry = true;
+			} else if (output->pause(dev, false)) {
+				close_output(output, dev);
+				clock_drained();
+				dev = NULL;
+			}
+		}
+		holding = false;
+		dev_paused = false;
+
+		if (atomic_read(&period_changed)) {
+			/* reopen with the new period */
+			atomic_write(&period_changed, false);
+			if (dev) {
+				close_output(output, dev);
+				clock_drained();
+				dev = NULL;
+			}
+		}
 
-	while (!quit) {
-		size_t avail;
+		struct buffer_event *event = get_buffer_event(&audio);
+		if (event) {
+			switch (event->type) {
+			case EVENT_FORMAT:
+				if (event->format.rate != format.rate ||
+				    event->format.channels != format.channels) {
+					/* reopen the device with the new format */
+					if (dev) {
+						close_output(output, dev);
+						clock_drained();
+					}
+					dev = NULL;
+					format = event->format;
+					timing = false;
+				}
+				status_cnt = 0;
+				reset_meter(&meter, format.channels);
+				break;
+			case EVENT_SEEK:
+				info("playback seek\n");
+				clock_segment(event->position);
+				timing = false;
+				seeked = true;
+				break;
+			case EVENT_SONG:
+				log_stats("song", &song_stats);
+				memset(&song_stats, 0, sizeof(song_stats));
+				show_cursor(&pending, &has_pending);
+				clock_segment(event->position);
+				pending = event->entry;
+				has_pending = true;
+				break;
+			}
+			buffer_event_done(&audio);
+			/* the decoder may wait for a free event slot to write
+			   or to seek, at any buffer fill */
+			wake_thread(&decode_cond, &decode_sleeping);
+			continue;
+		}
 
-		PLAY_LOCK;
-		avail = buffer_read_avail(&ds.buffer);
-		if (avail == 0 && !check_buffer_event(&ds.buffer)) {
+		size_t avail = buffer_read_avail(&audio);
+		size_t stale = buffer_stale(&audio);
+		if (avail && stale) {
+			/* audio before a seek, skip it */
+			if (avail > stale)
+				avail = stale;
+			buffer_processed(&audio, avail);
+			wake_decoder();
+			played = false;
+			timing = false;
+			continue;
+		}
+		if (avail == 0) {
+			if (played && atomic_read(&playing)) {
+				/* ran out of data in the middle of a song, the
+				   stall is measured at the next write */
+				info("buffer underrun\n");
+				record_stats(1, 0, 0, 0);
+			} else if (!atomic_read(&playing)) {
+				/* stopped or the queue has ran out */
+				timing = false;
+				ran_dry = true;
+			}
+			played = false;
+			/* nothing more is written, the device plays out
+			   what it has */
+			if (dev && output->idle)
+				output->idle(dev);
+			show_cursor(&pending, &has_pending);
 			/* buffer is empty, sleep */
-			pthread_cond_wait(&play_cond, &play_mutex);
-			PLAY_UNLOCK;
+			sleep_thread(&play_cond, &play_sleeping, play_ready,
+				     &play_wakeups);
 			continue;
 		}
-		PLAY_UNLOCK;
 
-		if (check_buffer_event(&ds.buffer) &&
-		    ds.toseek != (unsigned int) -1) {
-			info("playback seek\n");
-			ds.playposition = ds.toseek;
-			ds.toseek = -1;
-			ds.playpos_cnt = 0;
-		}
-
-		bool formatchg = check_buffer_event(&ds.buffer) &&
-			(ds.format.rate != (unsigned int) format.rate ||
-			 ds.format.channels != (unsigned int) format.channels);
-		if (formatchg || !dev) {
-			/* format changed detected or device is not open */
-			if (dev)
-				ao_close(dev);
-			info("open audio device: %u Hz, %u channels\n",
-				ds.format.rate, ds.format.channels);
-			format.rate = ds.format.rate;
-			format.channels = ds.format.channels;
-			power_cnt = 0;
-			power = 0;
-			ds.playpos_cnt = 0;
-			dev = ao_open_live(ao_default_driver_id(), &format, NULL);
+		unsigned int samplerate = format.rate * format.channels;
+		if (!dev) {
+			/* format has changed or device is not open */
+			dev = open_output(&output, &format);
+			size_t len = period_samples(&format);
+			if (dev && !output->get_buffer && output_len < len) {
+				sample_t *buf = realloc(output_buf,
+							len * sizeof(sample_t));
+				if (buf == NULL) {
+					close_output(output, dev);
+					dev = NULL;
+				} else {
+					output_buf = buf;
+					output_len = len;
+				}
+			}
 			if (dev == NULL) {
 				ui_show_message("Unable to open audio device");
 				/* remove from the buffer */
-				PLAY_LOCK;
-				buffer_processed(&ds.buffer, avail);
-				PLAY_UNLOCK;
-				playing = false;
+				buffer_processed(&audio, avail);
+				/* stop decoding */
+				struct command cmd = {.type = CMD_PAUSE};
+				queue_command(&decode_commands, &cmd, &decode_cond,
+					      &decode_sleeping);
 				continue;
 			}
+			clock_opened(samplerate);
+			xruns = 0;
+			timing = false;
+			latency = (size_t) get_setting_int("output_latency_msecs",
+							   0) * samplerate / 1000;
 		}
 
-		sample_t *buffer = read_buffer(&ds.buffer);
-
-		unsigned int samplerate = format.rate * format.channels;
-		if (avail > samplerate / REFRESH_RATE)
-			avail = samplerate / REFRESH_RATE;
-
-		size_t i;
-		if (volume != 256) {
-			for (i = 0; i < avail; ++i) {
-				int newsample = buffer[i] * volume / 256;
-				if (newsample < SHRT_MIN)
-					newsample = SHRT_MIN;
-				if (newsample > SHRT_MAX)
-					newsample = SHRT_MAX;
-				buffer[i] = newsample;
-			}
+		size_t period = period_samples(&format);
+		if (avail > period)
+			avail = period;
+		if (!output->get_buffer && avail > output_len)
+			avail = output_len;
+
+		if (timing) {
+			/* The work between writes is short, a longer gap
+			   means the thread was not run in time. A wait on the
+			   device happens inside the write and is not counted. */
+			unsigned long long gap = elapsed_usecs(&last_write);
+			unsigned long long chunk = last_len * 1000000ULL /
+				samplerate;
+			record_stats(0, 0, gap > chunk / 2, gap / 1000);
 		}
 
-		for (i = 31 - (power_cnt & 31); i < avail; i += 32) {
-			power += abs(buffer[i]) / 256;
-
-			int j = (power_cnt + i) / 32;
-			if (j < SCOPE_SIZE)
-				scope[j] = buffer[i];
+		sample_t *output_ptr = output_buf;
+		if (output->get_buffer) {
+			/* convert directly into the device buffer, whole
+			   frames only */
+			avail -= avail % format.channels;
+			output_ptr = output->get_buffer(dev, &avail);
+			if (output_ptr == NULL) {
+				warning("audio output error\n");
+				close_output(output, dev);
+				clock_drained();
+				dev = NULL;
+				continue;
+			}
 		}
-		power_cnt += avail;
-
-		ds.playpos_cnt += avail;
 
-		/* advance song position with full milliseconds from pos_cnt */
-		unsigned int adv = ds.playpos_cnt * 1000 / samplerate;
-		ds.playposition += adv;
-		ds.playpos_cnt -= adv * samplerate / 1000;
+		/* convert to the device format */
+		fsample_t *buffer = read_buffer(&audio);
+		float_to_s16(output_ptr, buffer, avail, volume / 256.0f);
 
-		/* Update UI status */
-		if (power_cnt >= samplerate / REFRESH_RATE) {
-			/* Scale power to 0..255 */
-			power = power * 64 / power_cnt;
+		measure_levels(&meter, buffer, avail);
 
-			/* Automatic volume adjust */
-			unsigned int zone = TARGET_POWER / 3;
-			if (autovol && (power < TARGET_POWER-zone || power > TARGET_POWER+zone)) {
-				volume += (TARGET_POWER - (int)power) / zone;
-				info("autovol %d%%\n", volume * 100 / 256);
+		/* every 32nd sample of the stream goes to the scope */
+		unsigned long long written = play_clock.written;
+		size_t i;
+		for (i = (32 - written % 32) % 32; i < avail; i += 32)
+			scope_history[(written + i) / 32 % SCOPE_HISTORY] =
+				output_ptr[i];
+		status_cnt += avail;
+
+		if (avail) {
+			int ret;
+			if (output->get_buffer)
+				ret = output->commit(dev, avail);
+			else
+				ret = output->play(dev, output_buf, avail);
+			if (ret) {
+				/* reopen the device on the next round */
+				warning("audio output error\n");
+				close_output(output, dev);
+				dev = NULL;
+			} else if (output->xruns) {
+				unsigned int n = output->xruns(dev);
+				if (n != xruns && !ran_dry)
+					record_stats(0, n - xruns, 0, 0);
+				xruns = n;
 			}
-
-			ui_set_status(scope, power_cnt / 32, ds.playposition);
-			power_cnt = 0;
-			power = 0;
+			ran_dry = false;
+			played = true;
+			clock_gettime(CLOCK_MONOTONIC, &last_write);
+			last_len = avail;
+			timing = dev != NULL;
 		}
 
-		if (avail)
-			ao_play(dev, (char *)buffer, avail * 2);
+		/* the clock follows what is heard, not what is written */
+		size_t delay = dev ? output_delay(output, dev, latency) : 0;
+		clock_written(avail, delay);
+		if (!dev)
+			clock_drained();
+		if (seeked && avail) {
+			info("seek heard after %u ms\n",
+			     command_latency(delay > avail ? delay - avail : 0,
+					     samplerate));
+			seeked = false;
+		}
+		if (has_pending && play_clock.audible >= play_clock.segs[1].start)
+			show_cursor(&pending, &has_pending);
+
+		/* Update UI status, not more often than it can follow */
+		if (status_cnt >= (size_t) samplerate * UI_REFRESH_MSECS / 1000) {
+			struct audio_levels levels;
+			read_meter(&meter, &levels, volume / 256.0f);
+
+			/* the scope shows the audio being heard */
+			size_t len = status_cnt / 32;
+			if (len > SCOPE_SIZE)
+				len = SCOPE_SIZE;
+			unsigned long long end = play_clock.audible / 32;
+			if (end + SCOPE_HISTORY < play_clock.written / 32 + len)
+				end = play_clock.written / 32 + len - SCOPE_HISTORY;
+			if (end < len)
+				len = end;
+			for (i = 0; i < len; ++i)
+				scope[i] = scope_history[(end - len + i) %
+							 SCOPE_HISTORY];
+
+			ui_set_status(scope, len, japlay_get_play_position(),
+				      &levels);
+			status_cnt = 0;
+		}
 
 		/* we are done with the audio data */
-		PLAY_LOCK;
-		buffer_processed(&ds.buffer, avail);
-		pthread_cond_signal(&decode_cond);
-		PLAY_UNLOCK;
+		buffer_processed(&audio, avail);
+		wake_decoder();
 	}
 
+	show_cursor(&pending, &has_pending);
 	if (dev)
-		ao_close(dev);
+		close_output(output, dev);
+	free(output_buf);
 	return NULL;
 }
 
@@ -466,7 +2072,7 @@ static void *scan_thread_routine(void *arg)
 {
 	UNUSED(arg);
 
-	while (!quit) {
+	while (!atomic_read(&quit)) {
 		SCAN_LOCK;
 		if (!scanning) {
 			/* we are not currently scanning, sleep */
@@ -540,14 +2146,6 @@ int load_playlist(struct playlist *playlist, const char *filename)
 	return plugin->load(playlist, filename);
 }
 
-static void kick_playback(void)
-{
-	PLAY_LOCK;
-	playing = true;
-	pthread_cond_signal(&decode_cond);
-	PLAY_UNLOCK;
-}
-
 void start_playlist_scan(void)
 {
 	SCAN_LOCK;
@@ -558,44 +2156,96 @@ void start_playlist_scan(void)
 
 void japlay_play(void)
 {
-	CURSOR_LOCK;
-	if (cursor == NULL)
-		advance_queue_locked();
-	CURSOR_UNLOCK;
-	kick_playback();
+	send_command(CMD_PLAY, 0);
+	if (autovol)
+		start_playlist_scan();
 }
 
 void japlay_set_autovol(bool enabled)
 {
 	autovol = enabled;
+	/* analyze the songs in the queue */
+	if (enabled)
+		start_playlist_scan();
 }
 
 void japlay_seek_relative(long msecs)
 {
-	japlay_seek(ds.playposition + msecs);
+	japlay_seek(japlay_get_play_position() + msecs);
 }
 
 void japlay_seek(long position)
 {
 	if (position < 0)
 		position = 0;
-	toseek = position;
+	clock_gettime(CLOCK_MONOTONIC, &command_time);
+	atomic_write(&seek_slot,
+		     (unsigned long long) atomic_read(&transport_sent) << 32 |
+		     (unsigned int) position);
+	wake_thread(&decode_cond, &decode_sleeping);
 }
 
+/* The buffered audio is played out */
 void japlay_stop(void)
 {
-	reset = true;
-	playing = false;
+	send_transport(CMD_STOP);
 }
 
+/* Output stops at once, the buffered audio is played when resumed */
 void japlay_pause(void)
 {
-	playing = false;
+	clock_gettime(CLOCK_MONOTONIC, &command_time);
+	send_command(CMD_PAUSE, 0);
+}
+
+/* 0 .. 256 */
+void japlay_set_volume(int vol)
+{
+	if (vol < 0)
+		vol = 0;
+	if (vol > 256)
+		vol = 256;
+	send_command(CMD_VOLUME, vol);
+}
+
+/* Select the DSP plugins, a comma separated list of their short names.
+   The chain is rebuilt by the decode thread. */
+void japlay_set_dsp(const char *names)
+{
+	char *copy = strdup(names);
+	if (copy == NULL)
+		return;
+	PLAY_LOCK;
+	free(dsp_names);
+	dsp_names = copy;
+	PLAY_UNLOCK;
+	atomic_write(&dsp_changed, true);
+	wake_thread(&decode_cond, &decode_sleeping);
+}
+
+/* Change the output period and the buffer length while playing. Zero
+   keeps the current value. */
+void japlay_set_latency(unsigned int period, unsigned int buffer)
+{
+	if (period) {
+		if (period > MAX_PERIOD_MSECS)
+			period = MAX_PERIOD_MSECS;
+		atomic_write(&period_msecs, period);
+		atomic_write(&period_changed, true);
+		/* the low watermark follows the period */
+		atomic_write(&buffer_changed, true);
+	}
+	if (buffer) {
+		atomic_write(&base_buffer_msecs, buffer);
+		atomic_write(&buffer_changed, true);
+	}
+	wake_thread(&decode_cond, &decode_sleeping);
+	wake_thread(&play_cond, &play_sleeping);
 }
 
 void japlay_skip(void)
 {
-	advance_queue();
+	send_transport(CMD_SKIP);
 }
 
 static int dummy_scan(struct song *song)
@@ -621,7 +2271,16 @@ static bool load_plugin(const char *filename)
 	get_input_plugin_t get_input_plugin
 		= (get_input_plugin_t *) dlsym(dl, "get_input_plugin");
 	if (get_input_plugin) {
-		struct input_plugin *info = get_input_plugin();
+		struct input_plugin *plugin_info = get_input_plugin();
+
+		/* copy to get the fields older plugins do not have zeroed */
+		struct input_plugin *info = NEW(struct input_plugin);
+		if (info == NULL)
+			return false;
+		size_t size = plugin_info->size;
+		if (size > sizeof(*info))
+			size = sizeof(*info);
+		memcpy(info, plugin_info, size);
 
 		if (info->seek == NULL)
 			info->seek = dummy_seek;
@@ -650,6 +2309,55 @@ static bool load_plugin(const char *filename)
 			list_add_tail(&plugin->head, &playlist_plugins);
 		}
 	}
+
+	get_output_plugin_t get_output_plugin
+		= (get_output_plugin_t *) dlsym(dl, "get_output_plugin");
+	if (get_output_plugin) {
+		struct output_plugin *plugin_info = get_output_plugin();
+
+		/* copy to get the fields older plugins do not have zeroed */
+		struct output_plugin *info = NEW(struct output_plugin);
+		if (info == NULL)
+			return false;
+		size_t size = plugin_info->size;
+		if (size > sizeof(*info))
+			size = sizeof(*info);
+		memcpy(info, plugin_info, size);
+
+		if (info->commit == NULL)
+			info->get_buffer = NULL;
+
+		info("found output plugin: %s (%s)\n", file_base(filename), info->name);
+
+		struct output_plugin_item *plugin = NEW(struct output_plugin_item);
+		if (plugin != NULL) {
+			plugin->info = info;
+			list_add_tail(&plugin->head, &output_plugins);
+		}
+	}
+
+	get_dsp_plugin_t get_dsp_plugin
+		= (get_dsp_plugin_t *) dlsym(dl, "get_dsp_plugin");
+	if (get_dsp_plugin) {
+		struct dsp_plugin *plugin_info = get_dsp_plugin();
+
+		/* copy to get the fields older plugins do not have zeroed */
+		struct dsp_plugin *info = NEW(struct dsp_plugin);
+		if (info == NULL)
+			return false;
+		size_t size = plugin_info->size;
+		if (size > sizeof(*info))
+			size = sizeof(*info);
+		memcpy(info, plugin_info, size);
+
+		info("found DSP plugin: %s (%s)\n", file_base(filename), info->name);
+
+		struct dsp_plugin_item *plugin = NEW(struct dsp_plugin_item);
+		if (plugin != NULL) {
+			plugin->info = info;
+			list_add_tail(&plugin->head, &dsp_plugins);
+		}
+	}
 	return true;
 }
 
@@ -657,6 +2365,9 @@ static void load_plugins(void)
 {
 	list_init(&input_plugins);
 	list_init(&playlist_plugins);
+	list_init(&output_plugins);
+	list_init(&dsp_plugins);
+	list_init(&dsp_chain);
 
 	DIR *dir = opendir(PLUGIN_DIR);
 	if (dir == NULL)
@@ -703,24 +2414,29 @@ int japlay_init(int *argc, char **argv)
 	}
 
 	init_settings();
+	load_latency_settings();
+	init_sample();
+	init_resample();
+	init_loudness();
 
-	ao_initialize();
 	load_plugins();
 
-	int count;
-	ao_info **drivers = ao_driver_info_list(&count);
-	for (i = 0; i < count; ++i) {
-		if (drivers[i]->type == AO_TYPE_LIVE) {
-			info("ao driver: %s (%s)\n", drivers[i]->short_name,
-				drivers[i]->name);
-		}
-	}
-
 	init_playlist();
 
-	memset(&ds, 0, sizeof(ds));
-	ds.toseek = -1;
-	init_buffer(&ds.buffer);
+	if (init_buffer(&audio)) {
+		error("Can not allocate audio buffer\n");
+		return -1;
+	}
+
+	/* 0: off, 1: play thread, 2: play and decode threads */
+	realtime_mode = get_setting_int("realtime", 0);
+	if (realtime_mode) {
+		if (lock_buffer(&audio) == 0)
+			buffer_locked = true;
+		else
+			warning("unable to lock the audio buffer in memory (%s)\n",
+				strerror(errno));
+	}
 
 	pthread_mutex_init(&cursor_mutex, NULL);
 
@@ -732,6 +2448,9 @@ int japlay_init(int *argc, char **argv)
 	pthread_cond_init(&decode_cond, NULL);
 	pthread_cond_init(&scan_cond, NULL);
 
+	init_command_queue(&decode_commands);
+	init_command_queue(&play_commands);
+
 	pthread_create(&decode_thread, NULL, decode_thread_routine, NULL);
 	pthread_create(&play_thread, NULL, play_thread_routine, NULL);
 	pthread_create(&scan_thread, NULL, scan_thread_routine, NULL);
@@ -744,12 +2463,16 @@ int japlay_init(int *argc, char **argv)
 
 void japlay_exit(void)
 {
-	quit = true;
+	PLAY_LOCK;
+	atomic_write(&quit, true);
 	pthread_cond_signal(&decode_cond);
 	pthread_cond_signal(&play_cond);
+	PLAY_UNLOCK;
 	pthread_cond_signal(&scan_cond);
 	void *retval;
 	pthread_join(decode_thread, &retval);
 	pthread_join(play_thread, &retval);
 	pthread_join(scan_thread, &retval);
+
+	log_stats("session", &session_stats);
 }
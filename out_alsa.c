@@ -0,0 +1,315 @@
+/*
+ * japlay ALSA output plugin
+ * Copyright Janne Kulmala 2010
+ *
+ * Uses mmap transfer mode: the player converts the samples directly into
+ * the device buffer, one or more whole periods at a time, and waits on the
+ * ALSA poll descriptors until the device has room.
+ */
+#define _GNU_SOURCE
+
+#include "plugin.h"
+#include "common.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <alsa/asoundlib.h>
+
+#define DEFAULT_DEVICE		"default"
+#define DEFAULT_PERIOD_USECS	20000
+#define DEFAULT_PERIODS		4
+
+struct output_plugin_ctx {
+	snd_pcm_t *pcm;
+	unsigned int channels;
+	snd_pcm_uframes_t period_size;
+	bool can_pause;
+	snd_pcm_uframes_t offset; /* area given by get_buffer */
+	struct pollfd *fds;
+	int nfds;
+	unsigned int xruns;
+};
+
+static int set_params(struct output_plugin_ctx *ctx,
+		      const struct input_format *format)
+{
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	unsigned int rate = format->rate;
+	/* follow the player when it writes in shorter periods */
+	unsigned int default_period = japlay_get_output_period() * 1000;
+	if (default_period > DEFAULT_PERIOD_USECS)
+		default_period = DEFAULT_PERIOD_USECS;
+	unsigned int period_usecs = get_setting_int("alsa_period_usecs",
+						    default_period);
+	unsigned int periods = get_setting_int("alsa_periods",
+					       DEFAULT_PERIODS);
+	snd_pcm_uframes_t buffer_size;
+	int err;
+
+	snd_pcm_hw_params_alloca(&hw);
+	snd_pcm_hw_params_any(ctx->pcm, hw);
+	if ((err = snd_pcm_hw_params_set_access(ctx->pcm, hw,
+			SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+	    (err = snd_pcm_hw_params_set_format(ctx->pcm, hw,
+			SND_PCM_FORMAT_S16)) < 0 ||
+	    (err = snd_pcm_hw_params_set_channels(ctx->pcm, hw,
+			format->channels)) < 0 ||
+	    (err = snd_pcm_hw_params_set_rate_near(ctx->pcm, hw, &rate,
+			NULL)) < 0 ||
+	    (err = snd_pcm_hw_params_set_period_time_near(ctx->pcm, hw,
+			&period_usecs, NULL)) < 0 ||
+	    (err = snd_pcm_hw_params_set_periods_near(ctx->pcm, hw,
+			&periods, NULL)) < 0 ||
+	    (err = snd_pcm_hw_params(ctx->pcm, hw)) < 0) {
+		warning("unable to configure ALSA device (%s)\n",
+			snd_strerror(err));
+		return -1;
+	}
+	if (rate != format->rate) {
+		warning("ALSA device does not support %u Hz\n", format->rate);
+		return -1;
+	}
+	snd_pcm_hw_params_get_period_size(hw, &ctx->period_size, NULL);
+	ctx->can_pause = snd_pcm_hw_params_can_pause(hw);
+	snd_pcm_hw_params_get_buffer_size(hw, &buffer_size);
+
+	/* wake up once per period, start playback when the
+	   buffer is full */
+	snd_pcm_sw_params_alloca(&sw);
+	snd_pcm_sw_params_current(ctx->pcm, sw);
+	if ((err = snd_pcm_sw_params_set_avail_min(ctx->pcm, sw,
+			ctx->period_size)) < 0 ||
+	    (err = snd_pcm_sw_params_set_start_threshold(ctx->pcm, sw,
+			buffer_size)) < 0 ||
+	    (err = snd_pcm_sw_params(ctx->pcm, sw)) < 0) {
+		warning("unable to configure ALSA device (%s)\n",
+			snd_strerror(err));
+		return -1;
+	}
+	info("ALSA period %lu frames, buffer %lu frames\n",
+	     (unsigned long) ctx->period_size, (unsigned long) buffer_size);
+	return 0;
+}
+
+static int alsa_open(struct output_plugin_ctx *ctx,
+		     const struct input_format *format)
+{
+	const char *device = get_setting("alsa_device");
+	if (device == NULL)
+		device = DEFAULT_DEVICE;
+
+	int err = snd_pcm_open(&ctx->pcm, device, SND_PCM_STREAM_PLAYBACK, 0);
+	if (err < 0) {
+		warning("unable to open ALSA device %s (%s)\n", device,
+			snd_strerror(err));
+		return -1;
+	}
+	ctx->channels = format->channels;
+	if (set_params(ctx, format))
+		goto err;
+
+	ctx->nfds = snd_pcm_poll_descriptors_count(ctx->pcm);
+	ctx->fds = calloc(ctx->nfds, sizeof(struct pollfd));
+	if (ctx->fds == NULL)
+		goto err;
+	snd_pcm_poll_descriptors(ctx->pcm, ctx->fds, ctx->nfds);
+	return 0;
+
+ err:
+	snd_pcm_close(ctx->pcm);
+	return -1;
+}
+
+static void alsa_close(struct output_plugin_ctx *ctx)
+{
+	snd_pcm_state_t state = snd_pcm_state(ctx->pcm);
+	if (state == SND_PCM_STATE_PAUSED)
+		/* draining would resume the held audio */
+		snd_pcm_drop(ctx->pcm);
+	else {
+		if (state == SND_PCM_STATE_PREPARED)
+			snd_pcm_start(ctx->pcm);
+		snd_pcm_drain(ctx->pcm);
+	}
+	snd_pcm_close(ctx->pcm);
+	free(ctx->fds);
+}
+
+/* Recover from an underrun or a suspend */
+static int recover(struct output_plugin_ctx *ctx, int err)
+{
+	info("ALSA recover (%s)\n", snd_strerror(err));
+	if (err == -EPIPE)
+		ctx->xruns++;
+	err = snd_pcm_recover(ctx->pcm, err, 1);
+	if (err < 0) {
+		warning("ALSA error (%s)\n", snd_strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/* Wait until at least a period can be written */
+static int wait_device(struct output_plugin_ctx *ctx)
+{
+	if (snd_pcm_state(ctx->pcm) == SND_PCM_STATE_PREPARED) {
+		/* the buffer is full but playback has not started */
+		int err = snd_pcm_start(ctx->pcm);
+		if (err < 0)
+			return recover(ctx, err);
+	}
+
+	for (;;) {
+		if (poll(ctx->fds, ctx->nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		unsigned short revents;
+		snd_pcm_poll_descriptors_revents(ctx->pcm, ctx->fds, ctx->nfds,
+						 &revents);
+		if (revents & POLLERR)
+			return recover(ctx, -EPIPE);
+		if (revents & POLLOUT)
+			return 0;
+	}
+}
+
+static sample_t *alsa_get_buffer(struct output_plugin_ctx *ctx, size_t *len)
+{
+	for (;;) {
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(ctx->pcm);
+		if (avail < 0) {
+			if (recover(ctx, avail))
+				return NULL;
+			continue;
+		}
+		if ((snd_pcm_uframes_t) avail < ctx->period_size) {
+			if (wait_device(ctx))
+				return NULL;
+			continue;
+		}
+
+		/* whole periods only, unless the caller has less than a
+		   period left */
+		snd_pcm_uframes_t frames = avail - avail % ctx->period_size;
+		snd_pcm_uframes_t want = *len / ctx->channels;
+		if (frames > want) {
+			frames = want;
+			if (want >= ctx->period_size)
+				frames -= want % ctx->period_size;
+		}
+
+		const snd_pcm_channel_area_t *areas;
+		int err = snd_pcm_mmap_begin(ctx->pcm, &areas, &ctx->offset,
+					     &frames);
+		if (err < 0) {
+			if (recover(ctx, err))
+				return NULL;
+			continue;
+		}
+		*len = frames * ctx->channels;
+		return (sample_t *) ((char *) areas[0].addr +
+			(areas[0].first + ctx->offset * areas[0].step) / 8);
+	}
+}
+
+static int alsa_commit(struct output_plugin_ctx *ctx, size_t len)
+{
+	snd_pcm_uframes_t frames = len / ctx->channels;
+	snd_pcm_sframes_t ret = snd_pcm_mmap_commit(ctx->pcm, ctx->offset,
+						    frames);
+	if (ret < 0 || (snd_pcm_uframes_t) ret != frames)
+		return recover(ctx, ret < 0 ? ret : -EPIPE);
+	return 0;
+}
+
+static int alsa_delay(struct output_plugin_ctx *ctx, size_t *len)
+{
+	snd_pcm_sframes_t frames;
+	if (snd_pcm_delay(ctx->pcm, &frames) < 0)
+		return -1;
+	*len = frames > 0 ? frames * ctx->channels : 0;
+	return 0;
+}
+
+static unsigned int alsa_xruns(struct output_plugin_ctx *ctx)
+{
+	return ctx->xruns;
+}
+
+/* Pause in the hardware if it can, otherwise drop the buffered audio so
+   that the device does not run dry and report an underrun on resume */
+static int alsa_pause(struct output_plugin_ctx *ctx, bool pause)
+{
+	snd_pcm_state_t state = snd_pcm_state(ctx->pcm);
+	int err = 0;
+	if (pause) {
+		if (state == SND_PCM_STATE_RUNNING && ctx->can_pause)
+			err = snd_pcm_pause(ctx->pcm, 1);
+		else if (state == SND_PCM_STATE_RUNNING ||
+			 state == SND_PCM_STATE_XRUN) {
+			err = snd_pcm_drop(ctx->pcm);
+			if (err == 0)
+				err = snd_pcm_prepare(ctx->pcm);
+		}
+	} else if (state == SND_PCM_STATE_PAUSED)
+		err = snd_pcm_pause(ctx->pcm, 0);
+	if (err < 0) {
+		warning("ALSA pause failed (%s)\n", snd_strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+/* Playback starts when the buffer is full, a shorter stream is started
+   here */
+static void alsa_idle(struct output_plugin_ctx *ctx)
+{
+	if (snd_pcm_state(ctx->pcm) == SND_PCM_STATE_PREPARED) {
+		int err = snd_pcm_start(ctx->pcm);
+		if (err < 0)
+			warning("unable to start ALSA device (%s)\n",
+				snd_strerror(err));
+	}
+}
+
+static int alsa_play(struct output_plugin_ctx *ctx, const sample_t *buffer,
+		     size_t len)
+{
+	while (len) {
+		size_t n = len;
+		sample_t *dst = alsa_get_buffer(ctx, &n);
+		if (dst == NULL)
+			return -1;
+		memcpy(dst, buffer, n * sizeof(sample_t));
+		if (alsa_commit(ctx, n))
+			return -1;
+		buffer += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static struct output_plugin plugin_info = {
+	.size = sizeof(struct output_plugin),
+	.ctx_size = sizeof(struct output_plugin_ctx),
+	.name = "ALSA mmap output",
+	.short_name = "alsa",
+	.open = alsa_open,
+	.close = alsa_close,
+	.play = alsa_play,
+	.get_buffer = alsa_get_buffer,
+	.commit = alsa_commit,
+	.delay = alsa_delay,
+	.xruns = alsa_xruns,
+	.pause = alsa_pause,
+	.idle = alsa_idle,
+};
+
+struct output_plugin *get_output_plugin()
+{
+	return &plugin_info;
+}
@@ -0,0 +1,68 @@
+/*
+ * japlay libao output plugin
+ * Copyright Janne Kulmala 2010
+ */
+#include "plugin.h"
+#include "common.h"
+#include <ao/ao.h>
+
+struct output_plugin_ctx {
+	ao_device *dev;
+};
+
+static int ao_plugin_init(void)
+{
+	ao_initialize();
+
+	int i, count;
+	ao_info **drivers = ao_driver_info_list(&count);
+	for (i = 0; i < count; ++i) {
+		if (drivers[i]->type == AO_TYPE_LIVE) {
+			info("ao driver: %s (%s)\n", drivers[i]->short_name,
+				drivers[i]->name);
+		}
+	}
+	return 0;
+}
+
+static int ao_plugin_open(struct output_plugin_ctx *ctx,
+			  const struct input_format *format)
+{
+	ao_sample_format aoformat = {.bits = 16,
+		.byte_format = AO_FMT_NATIVE, .rate = format->rate,
+		.channels = format->channels};
+
+	ctx->dev = ao_open_live(ao_default_driver_id(), &aoformat, NULL);
+	if (ctx->dev == NULL)
+		return -1;
+	return 0;
+}
+
+static void ao_plugin_close(struct output_plugin_ctx *ctx)
+{
+	ao_close(ctx->dev);
+}
+
+static int ao_plugin_play(struct output_plugin_ctx *ctx,
+			  const sample_t *buffer, size_t len)
+{
+	if (!ao_play(ctx->dev, (char *) buffer, len * sizeof(sample_t)))
+		return -1;
+	return 0;
+}
+
+static struct output_plugin plugin_info = {
+	.size = sizeof(struct output_plugin),
+	.ctx_size = sizeof(struct output_plugin_ctx),
+	.name = "libao audio output",
+	.short_name = "ao",
+	.init = ao_plugin_init,
+	.open = ao_plugin_open,
+	.close = ao_plugin_close,
+	.play = ao_plugin_play,
+};
+
+struct output_plugin *get_output_plugin()
+{
+	return &plugin_info;
+}
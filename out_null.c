@@ -0,0 +1,101 @@
+/*
+ * japlay null output plugin
+ * Copyright Janne Kulmala 2010
+ *
+ * Discards the audio. If "null_paced" is set, the samples are consumed in
+ * real time like a sound card would, otherwise as fast as the player can
+ * produce them. Useful for measuring the decoding pipeline.
+ */
+#define _GNU_SOURCE
+
+#include "plugin.h"
+#include "common.h"
+#include "settings.h"
+#include <time.h>
+#include <errno.h>
+
+struct output_plugin_ctx {
+	bool paced;
+	unsigned int samplerate;
+	struct timespec start;
+	unsigned long long played; /* samples since open */
+};
+
+static unsigned long long elapsed_usecs(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ULL +
+		now.tv_nsec / 1000 - start->tv_nsec / 1000;
+}
+
+static int null_open(struct output_plugin_ctx *ctx,
+		     const struct input_format *format)
+{
+	ctx->paced = get_setting_int("null_paced", 1);
+	ctx->samplerate = format->rate * format->channels;
+	ctx->played = 0;
+	clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+	return 0;
+}
+
+static void null_close(struct output_plugin_ctx *ctx)
+{
+	unsigned long long usecs = elapsed_usecs(&ctx->start);
+	unsigned long long msecs = ctx->played * 1000 / ctx->samplerate;
+	info("null output: %llu ms of audio in %llu ms\n", msecs,
+	     usecs / 1000);
+	if (usecs)
+		info("null output: %.1fx real time\n", msecs * 1000.0 / usecs);
+}
+
+static int null_play(struct output_plugin_ctx *ctx, const sample_t *buffer,
+		     size_t len)
+{
+	UNUSED(buffer);
+
+	ctx->played += len;
+	if (!ctx->paced)
+		return 0;
+
+	/* sleep until the device would have played the samples */
+	unsigned long long nsecs =
+		ctx->played * 1000000000ULL / ctx->samplerate;
+	struct timespec deadline = {
+		.tv_sec = ctx->start.tv_sec + nsecs / 1000000000,
+		.tv_nsec = ctx->start.tv_nsec + nsecs % 1000000000,
+	};
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+			       NULL) == EINTR)
+		;
+	return 0;
+}
+
+/* Samples that a real device would still be playing */
+static int null_delay(struct output_plugin_ctx *ctx, size_t *len)
+{
+	unsigned long long played =
+		elapsed_usecs(&ctx->start) * ctx->samplerate / 1000000;
+	*len = ctx->paced && ctx->played > played ? ctx->played - played : 0;
+	return 0;
+}
+
+static struct output_plugin plugin_info = {
+	.size = sizeof(struct output_plugin),
+	.ctx_size = sizeof(struct output_plugin_ctx),
+	.name = "Null output",
+	.short_name = "null",
+	.open = null_open,
+	.close = null_close,
+	.play = null_play,
+	.delay = null_delay,
+};
+
+struct output_plugin *get_output_plugin()
+{
+	return &plugin_info;
+}
@@ -0,0 +1,107 @@
+/*
+ * japlay raw PCM output plugin
+ * Copyright Janne Kulmala 2010
+ *
+ * Writes signed 16-bit native endian samples to the file or pipe given by
+ * the "raw_file" setting, or to the standard output if it is "-". The
+ * file is truncated when the player first opens it.
+ */
+#define _GNU_SOURCE
+
+#include "plugin.h"
+#include "common.h"
+#include "settings.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+struct output_plugin_ctx {
+	int fd;
+};
+
+/* the file is started over only once, reopening appends to it */
+static bool file_started = false;
+
+static int raw_open(struct output_plugin_ctx *ctx,
+		    const struct input_format *format)
+{
+	const char *filename = get_setting("raw_file");
+	if (filename == NULL)
+		filename = "-";
+
+	if (strcmp(filename, "-") == 0)
+		ctx->fd = STDOUT_FILENO;
+	else {
+		ctx->fd = open(filename, O_WRONLY | O_CREAT |
+			       (file_started ? O_APPEND : O_TRUNC), 0644);
+		if (ctx->fd < 0) {
+			warning("unable to open %s (%s)\n", filename,
+				strerror(errno));
+			return -1;
+		}
+		file_started = true;
+	}
+	info("raw output: %u Hz, %u channels\n", format->rate,
+	     format->channels);
+	return 0;
+}
+
+static void raw_close(struct output_plugin_ctx *ctx)
+{
+	if (ctx->fd != STDOUT_FILENO)
+		close(ctx->fd);
+}
+
+static int raw_play(struct output_plugin_ctx *ctx, const sample_t *buffer,
+		    size_t len)
+{
+	const char *data = (const char *) buffer;
+	size_t left = len * sizeof(sample_t);
+	int ret = 0;
+
+	/* a closed pipe is a write error, SIGPIPE is held back in this
+	   thread only and discarded */
+	sigset_t pipe_set, old_set;
+	sigemptyset(&pipe_set);
+	sigaddset(&pipe_set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+
+	while (left) {
+		ssize_t written = write(ctx->fd, data, left);
+		if (written < 0) {
+			if (errno == EINTR)
+				continue;
+			int err = errno;
+			if (err == EPIPE) {
+				struct timespec now = {.tv_sec = 0};
+				sigtimedwait(&pipe_set, NULL, &now);
+			}
+			warning("raw output write failed (%s)\n",
+				strerror(err));
+			ret = -1;
+			break;
+		}
+		data += written;
+		left -= written;
+	}
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+	return ret;
+}
+
+static struct output_plugin plugin_info = {
+	.size = sizeof(struct output_plugin),
+	.ctx_size = sizeof(struct output_plugin_ctx),
+	.name = "Raw PCM output",
+	.short_name = "raw",
+	.open = raw_open,
+	.close = raw_close,
+	.play = raw_play,
+};
+
+struct output_plugin *get_output_plugin()
+{
+	return &plugin_info;
+}
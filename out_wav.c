@@ -0,0 +1,151 @@
+/*
+ * japlay WAV file output plugin
+ * Copyright Janne Kulmala 2010
+ *
+ * Writes the audio to the file given by the "wav_file" setting. The file
+ * is started over when the player starts, and when the audio format
+ * changes. Reopening with the same format appends to it.
+ */
+#include "plugin.h"
+#include "common.h"
+#include "settings.h"
+#include <stdint.h>
+#include <errno.h>
+
+#define DEFAULT_FILE	"japlay.wav"
+#define HEADER_SIZE	44
+
+struct output_plugin_ctx {
+	FILE *f;
+	struct input_format format;
+	uint32_t datalen; /* in bytes */
+};
+
+/* format of the file written by this process, zero if none */
+static struct input_format file_format;
+
+static void put_le16(unsigned char *p, unsigned int val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+}
+
+static void put_le32(unsigned char *p, uint32_t val)
+{
+	put_le16(p, val);
+	put_le16(p + 2, val >> 16);
+}
+
+static int write_header(struct output_plugin_ctx *ctx)
+{
+	unsigned int align = ctx->format.channels * sizeof(sample_t);
+	unsigned char header[HEADER_SIZE];
+
+	memcpy(header, "RIFF", 4);
+	put_le32(&header[4], HEADER_SIZE - 8 + ctx->datalen);
+	memcpy(&header[8], "WAVEfmt ", 8);
+	put_le32(&header[16], 16);
+	put_le16(&header[20], 1); /* PCM */
+	put_le16(&header[22], ctx->format.channels);
+	put_le32(&header[24], ctx->format.rate);
+	put_le32(&header[28], ctx->format.rate * align);
+	put_le16(&header[32], align);
+	put_le16(&header[34], 16);
+	memcpy(&header[36], "data", 4);
+	put_le32(&header[40], ctx->datalen);
+
+	if (fseek(ctx->f, 0, SEEK_SET) ||
+	    fwrite(header, sizeof(header), 1, ctx->f) != 1)
+		return -1;
+	return 0;
+}
+
+/* Continue the file written before the device was reopened */
+static int append_file(struct output_plugin_ctx *ctx, const char *filename)
+{
+	ctx->f = fopen(filename, "r+b");
+	if (ctx->f == NULL)
+		return -1;
+	long size;
+	if (fseek(ctx->f, 0, SEEK_END) || (size = ftell(ctx->f)) < HEADER_SIZE) {
+		fclose(ctx->f);
+		return -1;
+	}
+	ctx->datalen = size - HEADER_SIZE;
+	return 0;
+}
+
+static int wav_open(struct output_plugin_ctx *ctx,
+		    const struct input_format *format)
+{
+	const char *filename = get_setting("wav_file");
+	if (filename == NULL)
+		filename = DEFAULT_FILE;
+
+	ctx->format = *format;
+	if (file_format.rate == format->rate &&
+	    file_format.channels == format->channels &&
+	    append_file(ctx, filename) == 0) {
+		info("appending audio to %s\n", filename);
+		return 0;
+	}
+
+	ctx->f = fopen(filename, "wb");
+	if (ctx->f == NULL) {
+		warning("unable to open %s (%s)\n", filename, strerror(errno));
+		return -1;
+	}
+	ctx->datalen = 0;
+
+	/* sizes are filled in when the file is closed */
+	if (write_header(ctx)) {
+		fclose(ctx->f);
+		return -1;
+	}
+	file_format = *format;
+	info("writing audio to %s\n", filename);
+	return 0;
+}
+
+static void wav_close(struct output_plugin_ctx *ctx)
+{
+	if (write_header(ctx))
+		warning("unable to finish the WAV file\n");
+	fclose(ctx->f);
+}
+
+static int wav_play(struct output_plugin_ctx *ctx, const sample_t *buffer,
+		    size_t len)
+{
+	unsigned char data[4096];
+	size_t i = 0;
+
+	/* WAV is always little endian */
+	while (i < len) {
+		size_t j, n = len - i;
+		if (n > sizeof(data) / 2)
+			n = sizeof(data) / 2;
+		for (j = 0; j < n; ++j)
+			put_le16(&data[j * 2], (unsigned short) buffer[i + j]);
+		if (fwrite(data, 2, n, ctx->f) != n)
+			return -1;
+		i += n;
+	}
+	ctx->datalen += len * 2;
+	return 0;
+}
+
+static struct output_plugin plugin_info = {
+	.size = sizeof(struct output_plugin),
+	.ctx_size = sizeof(struct output_plugin_ctx),
+	.name = "WAV file output",
+	.short_name = "wav",
+	.open = wav_open,
+	.close = wav_close,
+	.play = wav_play,
+};
+
+struct output_plugin *get_output_plugin()
+{
+	return &plugin_info;
+}
@@ -34,6 +34,8 @@ struct song {
 	int length_score;
 	unsigned int refcount, length;
 	char *filename, *title;
+	bool analyzed; /* loudness and peak are valid */
+	float loudness, peak;
 	struct list_head entries;
 };
 
@@ -88,6 +90,17 @@ unsigned int get_song_length(struct song *song)
 	return song->length;
 }
 
+/* Returns false if the song has not been analyzed */
+bool get_song_loudness(struct song *song, float *loudness, float *peak)
+{
+	DATABASE_LOCK;
+	bool analyzed = song->analyzed;
+	*loudness = song->loudness;
+	*peak = song->peak;
+	DATABASE_UNLOCK;
+	return analyzed;
+}
+
 void set_playlist_shuffle(struct playlist *playlist, bool enabled)
 {
 	playlist->shuffle = enabled;
@@ -213,6 +226,15 @@ void set_song_length(struct song *song, unsigned int length, int score)
 	}
 }
 
+void set_song_loudness(struct song *song, float loudness, float peak)
+{
+	DATABASE_LOCK;
+	song->loudness = loudness;
+	song->peak = peak;
+	song->analyzed = true;
+	DATABASE_UNLOCK;
+}
+
 void set_song_title(struct song *song, const char *str)
 {
 	/* TODO: locking */
@@ -243,6 +265,25 @@ struct playlist_entry *get_playlist_first(struct playlist *playlist)
 	return entry;
 }
 
+/* Returns the entry after the given one, or the first entry if the given
+   entry is no longer in the playlist */
+struct playlist_entry *get_playlist_next(struct playlist *playlist,
+					 struct playlist_entry *entry)
+{
+	PLAYLIST_LOCK(playlist);
+	struct list_head *pos = playlist->entries.next;
+	if (entry->playlist == playlist)
+		pos = entry->head.next;
+	struct playlist_entry *next = NULL;
+	if (pos != &playlist->entries) {
+		next = container_of(pos, struct playlist_entry, head);
+		get_entry(next);
+	}
+	PLAYLIST_UNLOCK(playlist);
+
+	return next;
+}
+
 struct playlist_entry *add_playlist(struct playlist *playlist, struct song *song,
 				    bool first)
 {
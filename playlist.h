@@ -16,6 +16,7 @@ struct playlist_ui_ctx *get_playlist_ui_ctx(struct playlist *playlist);
 const char *get_song_filename(struct song *song);
 char *get_song_title(struct song *song);
 unsigned int get_song_length(struct song *song);
+bool get_song_loudness(struct song *song, float *loudness, float *peak);
 
 void set_playlist_shuffle(struct playlist *playlist, bool enabled);
 struct song *find_song(const char *filename);
@@ -26,8 +27,11 @@ void put_song(struct song *song);
 void get_entry(struct playlist_entry *entry);
 void put_entry(struct playlist_entry *entry);
 void set_song_length(struct song *song, unsigned int length, int score);
+void set_song_loudness(struct song *song, float loudness, float peak);
 void set_song_title(struct song *song, const char *str);
 struct playlist_entry *get_playlist_first(struct playlist *playlist);
+struct playlist_entry *get_playlist_next(struct playlist *playlist,
+					 struct playlist_entry *entry);
 struct playlist_entry *add_playlist(struct playlist *playlist, struct song *song,
 				    bool first);
 void remove_playlist(struct playlist *playlist, struct playlist_entry *entry);
@@ -18,8 +18,11 @@ struct song;
 struct playlist;
 struct input_state;
 struct input_plugin_ctx;
+struct output_plugin_ctx;
+struct dsp_plugin_ctx;
 
 typedef signed short sample_t;
+typedef float fsample_t; /* internal sample format, -1.0 .. 1.0 */
 
 struct input_plugin {
 	/* Size of this structure, used for versioning */
@@ -48,7 +51,7 @@ struct input_plugin {
 
 	/* Fill given buffer with audio samples. Should return the
 	   number of samples written to the buffer, and fill all fields
-	   in the format structure.
+	   in the format structure. maxlen is at least MIN_FILL.
 	   Return 0 for EOF or in case of an error. */
 	size_t (*fillbuf)(struct input_plugin_ctx *ctx, sample_t *buffer,
 			  size_t maxlen, struct input_format *format);
@@ -58,6 +61,24 @@ struct input_plugin {
 
 	/* NULL-terminated list of mime types the plugin can handle */
 	const char **mime_types;
+
+	/* Same as fillbuf, but produces floating point samples. Used instead
+	   of fillbuf if provided. Older plugins do not have this field. */
+	size_t (*fillbuf_float)(struct input_plugin_ctx *ctx,
+				fsample_t *buffer, size_t maxlen,
+				struct input_format *format);
+
+	/* Set if the plugin can only have one file open at a time. The next
+	   song is then not opened before the current one has ended. */
+	bool single_instance;
+
+	/* Version 2 of fillbuf. If set, fillbuf and fillbuf_float fill as
+	   much of the buffer as they can in one call, and keep the samples
+	   that did not fit (e.g. the rest of a decoded frame) for the next
+	   call. The samples of one call are always in a single format. Older
+	   plugins may return as little as one frame per call, the player
+	   then calls them repeatedly to fill a chunk. */
+	bool fill_buffer;
 };
 
 struct playlist_plugin {
@@ -73,18 +94,137 @@ struct playlist_plugin {
 	int (*load)(struct playlist *playlist, const char *filename);
 };
 
+struct output_plugin {
+	/* Size of this structure, used for versioning */
+	size_t size;
+
+	/* Size of plugin context */
+	size_t ctx_size;
+
+	/* Name of the plugin */
+	const char *name;
+
+	/* Short name used to select the plugin with the "output" setting */
+	const char *short_name;
+
+	/* Called once before the plugin is first opened. Optional. */
+	int (*init)(void);
+
+	/* Open the output with the given format. Context is allocated and
+	   zeroed by the caller. Return -1 if unable to open. */
+	int (*open)(struct output_plugin_ctx *ctx,
+		    const struct input_format *format);
+
+	/* Called when the output is closed. Context is freed by the caller */
+	void (*close)(struct output_plugin_ctx *ctx);
+
+	/* Play the given interleaved samples. Should block until the samples
+	   have been accepted by the device. Return -1 in case of an error. */
+	int (*play)(struct output_plugin_ctx *ctx, const sample_t *buffer,
+		    size_t len);
+
+	/* Optional direct access to the device buffer. get_buffer waits until
+	   the device has room and returns where up to *len samples can be
+	   written, or NULL in case of an error. commit passes the first len
+	   samples of that area to the device. Used instead of play if
+	   provided. */
+	sample_t *(*get_buffer)(struct output_plugin_ctx *ctx, size_t *len);
+	int (*commit)(struct output_plugin_ctx *ctx, size_t len);
+
+	/* Store the number of samples that have been written but are not
+	   yet audible in *len. Optional, return -1 if unknown. */
+	int (*delay)(struct output_plugin_ctx *ctx, size_t *len);
+
+	/* Number of times the device has run out of data since it was
+	   opened. Optional. */
+	unsigned int (*xruns)(struct output_plugin_ctx *ctx);
+
+	/* Stop the device during a pause and continue when pause is false,
+	   keeping the audio not yet played if the device can. Without this
+	   the device runs out of data while paused. Optional, return -1 in
+	   case of an error. */
+	int (*pause)(struct output_plugin_ctx *ctx, bool pause);
+
+	/* Called when the player has no more samples to write for now. The
+	   device should play what it has even if it has not started yet.
+	   Optional. */
+	void (*idle)(struct output_plugin_ctx *ctx);
+};
+
+/* Signal processing in the decode thread, before the audio buffer. The
+   plugins selected with the "dsp" setting are run in the given order. */
+struct dsp_plugin {
+	/* Size of this structure, used for versioning */
+	size_t size;
+
+	/* Size of plugin context */
+	size_t ctx_size;
+
+	/* Name of the plugin */
+	const char *name;
+
+	/* Short name used in the "dsp" setting */
+	const char *short_name;
+
+	/* Set up for the given format, called before the first process call
+	   and whenever the format changes. Context is allocated and zeroed
+	   by the caller. Return -1 if the format is not supported, the
+	   plugin is then skipped until the format changes again. */
+	int (*configure)(struct dsp_plugin_ctx *ctx,
+			 const struct input_format *format);
+
+	/* Process the interleaved samples in place. Length is a whole number
+	   of frames. */
+	void (*process)(struct dsp_plugin_ctx *ctx, fsample_t *buffer,
+			size_t len);
+
+	/* Forget the audio history, e.g. after a seek. Optional. */
+	void (*reset)(struct dsp_plugin_ctx *ctx);
+
+	/* Called when the plugin is removed from the chain. Context is freed
+	   by the caller. Optional. */
+	void (*close)(struct dsp_plugin_ctx *ctx);
+
+	/* Set if the plugin keeps the output below full scale without
+	   clipping. Loudness normalization can then raise quiet songs past
+	   their peak level. */
+	bool limiter;
+
+	/* Like process, but a plugin that delays the audio may write less
+	   than it was given while the delay fills up after a reset. Returns
+	   the number of samples written to the start of the buffer. Used
+	   instead of process if provided. Optional. */
+	size_t (*process_delayed)(struct dsp_plugin_ctx *ctx,
+				  fsample_t *buffer, size_t len);
+
+	/* Write out the audio still in the delay at the end of the queue,
+	   at most maxlen samples. Returns the number of samples written,
+	   zero when the delay is empty. Optional. */
+	size_t (*drain)(struct dsp_plugin_ctx *ctx, fsample_t *buffer,
+			size_t maxlen);
+};
+
 typedef struct input_plugin *(*get_input_plugin_t)(void);
 typedef struct playlist_plugin *(*get_playlist_plugin_t)(void);
+typedef struct output_plugin *(*get_output_plugin_t)(void);
+typedef struct dsp_plugin *(*get_dsp_plugin_t)(void);
 
 struct input_plugin *get_input_plugin(void);
 struct playlist_plugin *get_playlist_plugin(void);
+struct output_plugin *get_output_plugin(void);
+struct dsp_plugin *get_dsp_plugin(void);
 
 /* Getters: */
 struct song *get_input_song(struct input_state *state);
 
-/* Call this to get current position in milliseconds */
+/* Call this to get the position of the audio returned so far, in
+   milliseconds */
 unsigned int japlay_get_position(struct input_state *state);
 
+/* Period the player writes the audio in, in milliseconds. Output plugins
+   can use it to size their own buffers. */
+unsigned int japlay_get_output_period(void);
+
 void set_streaming_title(struct song *song, const char *title);
 
 #endif
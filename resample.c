@@ -0,0 +1,286 @@
+/*
+ * japlay - Just Another Player
+ * Copyright Janne Kulmala 2010
+ */
+#include "resample.h"
+#include "common.h"
+#include <stdlib.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+/*
+ * Rational polyphase resampler. The input is kept as one array per
+ * channel, so each output sample is a single dot product of consecutive
+ * input samples and the coefficients of the current phase. With a rate
+ * ratio of phases/step, the phase advances by "step" for each output
+ * sample and wraps over to the next input sample.
+ */
+
+#define MAX_PHASES	1024
+
+#ifndef M_PI
+#define M_PI		3.14159265358979323846
+#endif
+
+static const struct {
+	unsigned int taps; /* multiple of 8 */
+	float cutoff; /* relative to the lower Nyquist frequency */
+	double beta; /* Kaiser window */
+} qualities[] = {
+	[RESAMPLE_FAST] = {8, 0.75f, 5.0},
+	[RESAMPLE_MEDIUM] = {16, 0.86f, 7.0},
+	[RESAMPLE_BEST] = {32, 0.92f, 9.0},
+};
+
+static float dot_c(const float *a, const float *b, unsigned int len)
+{
+	float sum = 0;
+	unsigned int i;
+	for (i = 0; i < len; ++i)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static float dot_sse2(const float *a, const float *b, unsigned int len)
+{
+	__m128 sum0 = _mm_setzero_ps(), sum1 = _mm_setzero_ps();
+	unsigned int i;
+	for (i = 0; i < len; i += 8) {
+		sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(&a[i]),
+						   _mm_loadu_ps(&b[i])));
+		sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(&a[i + 4]),
+						   _mm_loadu_ps(&b[i + 4])));
+	}
+	sum0 = _mm_add_ps(sum0, sum1);
+	sum0 = _mm_add_ps(sum0, _mm_movehl_ps(sum0, sum0));
+	sum0 = _mm_add_ss(sum0, _mm_shuffle_ps(sum0, sum0, 1));
+	return _mm_cvtss_f32(sum0);
+}
+
+__attribute__((target("avx")))
+static float dot_avx(const float *a, const float *b, unsigned int len)
+{
+	__m256 sum = _mm256_setzero_ps();
+	unsigned int i;
+	for (i = 0; i < len; i += 8)
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_loadu_ps(&a[i]),
+						       _mm256_loadu_ps(&b[i])));
+	__m128 half = _mm_add_ps(_mm256_castps256_ps128(sum),
+				 _mm256_extractf128_ps(sum, 1));
+	half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+	half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+	return _mm_cvtss_f32(half);
+}
+
+#endif
+
+/* Lengths are multiples of 8 */
+static float (*dot_func)(const float *a, const float *b, unsigned int len)
+	= dot_c;
+
+static unsigned int gcd(unsigned int a, unsigned int b)
+{
+	while (b) {
+		unsigned int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Modified Bessel function of the first kind, order zero */
+static double bessel_i0(double x)
+{
+	double sum = 1, term = 1;
+	unsigned int k;
+	for (k = 1; k < 32; ++k) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+static int make_filter(struct resampler *r, enum resample_quality quality)
+{
+	unsigned int taps = qualities[quality].taps;
+	double beta = qualities[quality].beta;
+	double cutoff = qualities[quality].cutoff;
+	if (r->out.rate < r->in.rate)
+		cutoff = cutoff * r->out.rate / r->in.rate;
+
+	float *coeffs = malloc(r->phases * taps * sizeof(float));
+	if (coeffs == NULL)
+		return -1;
+
+	unsigned int p, k;
+	for (p = 0; p < r->phases; ++p) {
+		float *c = &coeffs[p * taps];
+		double sum = 0;
+		for (k = 0; k < taps; ++k) {
+			/* distance from the output position, in input
+			   samples */
+			double t = (double) p / r->phases + taps / 2 - 1 - k;
+			double x = t / (taps / 2);
+			double h = cutoff;
+			if (t != 0)
+				h = sin(M_PI * cutoff * t) / (M_PI * t);
+			if (x < 1)
+				h *= bessel_i0(beta * sqrt(1 - x * x)) /
+					bessel_i0(beta);
+			else
+				h = 0;
+			c[k] = h;
+			sum += h;
+		}
+		/* unity gain for every phase */
+		for (k = 0; k < taps; ++k)
+			c[k] /= sum;
+	}
+	free(r->coeffs);
+	r->coeffs = coeffs;
+	r->taps = taps;
+	return 0;
+}
+
+int setup_resampler(struct resampler *r, const struct input_format *in,
+		    const struct input_format *out,
+		    enum resample_quality quality)
+{
+	if (quality > RESAMPLE_BEST)
+		quality = RESAMPLE_BEST;
+
+	r->in = *in;
+	r->out = *out;
+	if (r->out.channels > RESAMPLE_MAX_CHANNELS)
+		r->out.channels = RESAMPLE_MAX_CHANNELS;
+	r->taps = 0;
+
+	if (in->rate != out->rate) {
+		unsigned int div = gcd(in->rate, out->rate);
+		r->phases = out->rate / div;
+		r->step = in->rate / div;
+		if (r->phases > MAX_PHASES) {
+			/* approximate the ratio, the error is small for
+			   the unusual rates that need this */
+			r->step = (r->step * (double) MAX_PHASES + r->phases / 2)
+				/ r->phases;
+			r->phases = MAX_PHASES;
+		}
+		if (make_filter(r, quality))
+			return -1;
+		info("resampling %u Hz to %u Hz, %u phases, %u taps\n",
+		     in->rate, out->rate, r->phases, r->taps);
+	}
+	reset_resampler(r);
+	return 0;
+}
+
+/* Forget the buffered input, e.g. after a seek */
+void reset_resampler(struct resampler *r)
+{
+	unsigned int ch;
+	r->pos = 0;
+	r->phase = 0;
+	r->len = 0;
+	if (r->taps) {
+		/* the first output sample is centered on the first input */
+		r->len = r->taps / 2 - 1;
+		for (ch = 0; ch < r->out.channels; ++ch)
+			memset(r->history[ch], 0, r->len * sizeof(float));
+	}
+}
+
+/* Returns channel "ch" of a frame in the output layout */
+static float map_channel(const fsample_t *frame, unsigned int channels,
+			 unsigned int out_channels, unsigned int ch)
+{
+	if (out_channels == 1 && channels >= 2)
+		return (frame[0] + frame[1]) * 0.5f;
+	if (ch < channels)
+		return frame[ch];
+	/* mono to all channels, others silent */
+	return channels == 1 ? frame[0] : 0;
+}
+
+size_t resample(struct resampler *r, fsample_t *out, size_t maxlen,
+		const fsample_t *in, size_t *inlen)
+{
+	unsigned int channels = r->in.channels, out_channels = r->out.channels;
+	size_t frames = *inlen / channels;
+	size_t out_frames = maxlen / out_channels;
+	size_t i, done = 0;
+	unsigned int ch;
+
+	if (r->taps == 0) {
+		/* same rate, only map the channels */
+		if (frames > out_frames)
+			frames = out_frames;
+		if (channels == out_channels)
+			memcpy(out, in, frames * channels * sizeof(fsample_t));
+		else {
+			for (i = 0; i < frames; ++i) {
+				for (ch = 0; ch < out_channels; ++ch)
+					out[i * out_channels + ch] =
+						map_channel(&in[i * channels],
+							    channels,
+							    out_channels, ch);
+			}
+		}
+		*inlen = frames * channels;
+		return frames * out_channels;
+	}
+
+	/* append the input to the history */
+	if (frames > RESAMPLE_HISTORY - r->len)
+		frames = RESAMPLE_HISTORY - r->len;
+	for (ch = 0; ch < out_channels; ++ch) {
+		float *history = &r->history[ch][r->len];
+		for (i = 0; i < frames; ++i)
+			history[i] = map_channel(&in[i * channels], channels,
+						 out_channels, ch);
+	}
+	r->len += frames;
+	*inlen = frames * channels;
+
+	while (done < out_frames && r->pos + r->taps <= r->len) {
+		const float *coeffs = &r->coeffs[r->phase * r->taps];
+		for (ch = 0; ch < out_channels; ++ch)
+			out[done * out_channels + ch] =
+				dot_func(&r->history[ch][r->pos], coeffs,
+					 r->taps);
+		done++;
+		r->phase += r->step;
+		r->pos += r->phase / r->phases;
+		r->phase %= r->phases;
+	}
+
+	/* drop the history that is no longer needed */
+	size_t drop = r->pos < r->len ? r->pos : r->len;
+	if (drop) {
+		for (ch = 0; ch < out_channels; ++ch)
+			memmove(r->history[ch], &r->history[ch][drop],
+				(r->len - drop) * sizeof(float));
+		r->pos -= drop;
+		r->len -= drop;
+	}
+	return done * out_channels;
+}
+
+/* Select the fastest implementation the CPU supports */
+void init_resample(void)
+{
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx"))
+		dot_func = dot_avx;
+	else if (__builtin_cpu_supports("sse2"))
+		dot_func = dot_sse2;
+#endif
+}
@@ -0,0 +1,40 @@
+#ifndef _JAPLAY_RESAMPLE_H_
+#define _JAPLAY_RESAMPLE_H_
+
+#include <string.h> /* size_t */
+#include "plugin.h"
+
+#define RESAMPLE_MAX_CHANNELS	8
+#define RESAMPLE_HISTORY	0x1000 /* input frames kept per channel */
+
+/* Quality levels, higher costs more CPU */
+enum resample_quality {
+	RESAMPLE_FAST,
+	RESAMPLE_MEDIUM,
+	RESAMPLE_BEST,
+};
+
+/* Polyphase resampler and channel mapper. A zeroed structure is valid. */
+struct resampler {
+	struct input_format in, out;
+	unsigned int taps; /* 0 if only the channels are mapped */
+	unsigned int phases, step, phase;
+	float *coeffs; /* taps coefficients for each phase */
+	size_t pos, len; /* in frames */
+	float history[RESAMPLE_MAX_CHANNELS][RESAMPLE_HISTORY];
+};
+
+int setup_resampler(struct resampler *r, const struct input_format *in,
+		    const struct input_format *out,
+		    enum resample_quality quality);
+void reset_resampler(struct resampler *r);
+
+/* Convert samples from "in" to "out". The number of input samples
+   consumed is returned in inlen, and the number of output samples
+   as the return value. */
+size_t resample(struct resampler *r, fsample_t *out, size_t maxlen,
+		const fsample_t *in, size_t *inlen);
+
+void init_resample(void);
+
+#endif
@@ -0,0 +1,305 @@
+/*
+ * japlay - Just Another Player
+ * Copyright Janne Kulmala 2010
+ */
+#include "sample.h"
+#include "common.h"
+#include <limits.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define HAVE_X86
+#include <immintrin.h>
+#endif
+
+/* Source and destination can be the same buffer */
+void s16_to_float(fsample_t *dst, const sample_t *src, size_t len)
+{
+	/* go backwards, so in-place conversion does not overwrite the
+	   samples not yet converted */
+	while (len) {
+		len--;
+		dst[len] = src[len] * (1.0f / 32768);
+	}
+}
+
+void scale_samples(fsample_t *buf, size_t len, float gain)
+{
+	size_t i;
+	for (i = 0; i < len; ++i)
+		buf[i] *= gain;
+}
+
+static void float_to_s16_c(sample_t *dst, const fsample_t *src, size_t len,
+			   float gain)
+{
+	size_t i;
+	gain *= 32768;
+	for (i = 0; i < len; ++i) {
+		float sample = src[i] * gain;
+		if (sample < SHRT_MIN)
+			sample = SHRT_MIN;
+		if (sample > SHRT_MAX)
+			sample = SHRT_MAX;
+		dst[i] = sample;
+	}
+}
+
+#ifdef HAVE_X86
+
+/* The float clamp keeps the integer conversion from overflowing, packing
+   then saturates to 16 bits */
+
+__attribute__((target("sse2")))
+static void float_to_s16_sse2(sample_t *dst, const fsample_t *src,
+			      size_t len, float gain)
+{
+	const __m128 g = _mm_set1_ps(gain * 32768);
+	const __m128 lo = _mm_set1_ps(SHRT_MIN);
+	const __m128 hi = _mm_set1_ps(SHRT_MAX);
+	size_t i;
+	for (i = 0; i + 8 <= len; i += 8) {
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(&src[i]), g);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(&src[i + 4]), g);
+		a = _mm_min_ps(_mm_max_ps(a, lo), hi);
+		b = _mm_min_ps(_mm_max_ps(b, lo), hi);
+		__m128i out = _mm_packs_epi32(_mm_cvttps_epi32(a),
+					      _mm_cvttps_epi32(b));
+		_mm_storeu_si128((__m128i *) &dst[i], out);
+	}
+	float_to_s16_c(&dst[i], &src[i], len - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void float_to_s16_avx2(sample_t *dst, const fsample_t *src,
+			      size_t len, float gain)
+{
+	const __m256 g = _mm256_set1_ps(gain * 32768);
+	const __m256 lo = _mm256_set1_ps(SHRT_MIN);
+	const __m256 hi = _mm256_set1_ps(SHRT_MAX);
+	size_t i;
+	for (i = 0; i + 16 <= len; i += 16) {
+		__m256 a = _mm256_mul_ps(_mm256_loadu_ps(&src[i]), g);
+		__m256 b = _mm256_mul_ps(_mm256_loadu_ps(&src[i + 8]), g);
+		a = _mm256_min_ps(_mm256_max_ps(a, lo), hi);
+		b = _mm256_min_ps(_mm256_max_ps(b, lo), hi);
+		__m256i out = _mm256_packs_epi32(_mm256_cvttps_epi32(a),
+						 _mm256_cvttps_epi32(b));
+		/* packing works within 128-bit lanes, restore the order */
+		out = _mm256_permute4x64_epi64(out, 0xd8);
+		_mm256_storeu_si256((__m256i *) &dst[i], out);
+	}
+	float_to_s16_sse2(&dst[i], &src[i], len - i, gain);
+}
+
+#endif
+
+static void measure_c(struct level_meter *meter, const fsample_t *buf,
+		      size_t frames)
+{
+	unsigned int channels = meter->channels;
+	unsigned int right = (channels > 1) ? 1 : 0;
+	size_t i;
+	for (i = 0; i < frames; ++i) {
+		float l = buf[i * channels];
+		float r = buf[i * channels + right];
+		meter->sum[0] += l * l;
+		meter->sum[1] += r * r;
+		meter->cross += l * r;
+		if (fabsf(l) > meter->peak[0])
+			meter->peak[0] = fabsf(l);
+		if (fabsf(r) > meter->peak[1])
+			meter->peak[1] = fabsf(r);
+	}
+}
+
+/* sin(x * pi / 2) for 0 <= x <= 1, error below 1e-5 */
+static float quarter_sin(float x)
+{
+	float x2 = x * x;
+	return x * (1.5707963f + x2 * (-0.6459641f + x2 * (0.0796926f +
+		x2 * (-0.0046818f + x2 * 0.0001604f))));
+}
+
+static void mix_fade_c(fsample_t *dst, const fsample_t *src, size_t len,
+		       unsigned int channels, size_t pos, size_t total)
+{
+	float step = 1.0f / total;
+	size_t i;
+	unsigned int ch;
+	for (i = 0; i < len; i += channels, ++pos) {
+		float x = (pos + 0.5f) * step;
+		float in = quarter_sin(x), out = quarter_sin(1 - x);
+		for (ch = 0; ch < channels; ++ch)
+			dst[i + ch] = dst[i + ch] * out + src[i + ch] * in;
+	}
+}
+
+#ifdef HAVE_X86
+
+__attribute__((target("sse2")))
+static __m128 quarter_sin_sse2(__m128 x)
+{
+	__m128 x2 = _mm_mul_ps(x, x);
+	__m128 y = _mm_set1_ps(0.0001604f);
+	y = _mm_add_ps(_mm_mul_ps(y, x2), _mm_set1_ps(-0.0046818f));
+	y = _mm_add_ps(_mm_mul_ps(y, x2), _mm_set1_ps(0.0796926f));
+	y = _mm_add_ps(_mm_mul_ps(y, x2), _mm_set1_ps(-0.6459641f));
+	y = _mm_add_ps(_mm_mul_ps(y, x2), _mm_set1_ps(1.5707963f));
+	return _mm_mul_ps(y, x);
+}
+
+/* Interleaved stereo or mono, four samples at a time */
+__attribute__((target("sse2")))
+static void mix_fade_sse2(fsample_t *dst, const fsample_t *src, size_t len,
+			  unsigned int channels, size_t pos, size_t total)
+{
+	const __m128 step = _mm_set1_ps(1.0f / total);
+	const __m128 one = _mm_set1_ps(1);
+	const __m128 lane = channels == 1 ? _mm_set_ps(3, 2, 1, 0)
+					  : _mm_set_ps(1, 1, 0, 0);
+	size_t i;
+	for (i = 0; i + 4 <= len; i += 4, pos += 4 / channels) {
+		__m128 x = _mm_add_ps(_mm_set1_ps(pos + 0.5f), lane);
+		x = _mm_mul_ps(x, step);
+		__m128 in = quarter_sin_sse2(x);
+		__m128 out = quarter_sin_sse2(_mm_sub_ps(one, x));
+		__m128 a = _mm_mul_ps(_mm_loadu_ps(&dst[i]), out);
+		__m128 b = _mm_mul_ps(_mm_loadu_ps(&src[i]), in);
+		_mm_storeu_ps(&dst[i], _mm_add_ps(a, b));
+	}
+	mix_fade_c(&dst[i], &src[i], len - i, channels, pos, total);
+}
+
+/* Interleaved stereo or mono, two frames or four samples at a time */
+__attribute__((target("sse2")))
+static void measure_sse2(struct level_meter *meter, const fsample_t *buf,
+			 size_t frames)
+{
+	const __m128 absmask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+	__m128 sum = _mm_setzero_ps();
+	__m128 cross = _mm_setzero_ps();
+	__m128 peak = _mm_setzero_ps();
+	size_t len = frames * meter->channels;
+	size_t i;
+	for (i = 0; i + 4 <= len; i += 4) {
+		__m128 x = _mm_loadu_ps(&buf[i]);
+		/* swap left and right for the cross product */
+		__m128 y = _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1));
+		sum = _mm_add_ps(sum, _mm_mul_ps(x, x));
+		cross = _mm_add_ps(cross, _mm_mul_ps(x, y));
+		peak = _mm_max_ps(peak, _mm_and_ps(x, absmask));
+	}
+
+	float s[4], c[4], p[4];
+	_mm_storeu_ps(s, sum);
+	_mm_storeu_ps(c, cross);
+	_mm_storeu_ps(p, peak);
+	if (meter->channels == 1) {
+		/* all lanes belong to the same channel */
+		float total = s[0] + s[1] + s[2] + s[3];
+		meter->sum[0] += total;
+		meter->sum[1] += total;
+		meter->cross += total;
+		p[0] = fmaxf(fmaxf(p[0], p[1]), fmaxf(p[2], p[3]));
+		p[1] = p[0];
+	} else {
+		meter->sum[0] += s[0] + s[2];
+		meter->sum[1] += s[1] + s[3];
+		meter->cross += c[0] + c[2];
+		p[0] = fmaxf(p[0], p[2]);
+		p[1] = fmaxf(p[1], p[3]);
+	}
+	if (p[0] > meter->peak[0])
+		meter->peak[0] = p[0];
+	if (p[1] > meter->peak[1])
+		meter->peak[1] = p[1];
+
+	i /= meter->channels;
+	measure_c(meter, &buf[i * meter->channels], frames - i);
+}
+
+#endif
+
+static void (*float_to_s16_func)(sample_t *dst, const fsample_t *src,
+				 size_t len, float gain) = float_to_s16_c;
+static void (*measure_func)(struct level_meter *meter, const fsample_t *buf,
+			    size_t frames) = measure_c;
+static void (*mix_fade_func)(fsample_t *dst, const fsample_t *src, size_t len,
+			     unsigned int channels, size_t pos,
+			     size_t total) = mix_fade_c;
+
+/* Applies the gain, clips and converts to 16-bit */
+void float_to_s16(sample_t *dst, const fsample_t *src, size_t len,
+		  float gain)
+{
+	float_to_s16_func(dst, src, len, gain);
+}
+
+/* Mix src into dst with an equal-power crossfade. dst fades out and src
+   fades in over "total" frames, starting at frame "pos" of the fade. */
+void mix_fade(fsample_t *dst, const fsample_t *src, size_t len,
+	      unsigned int channels, size_t pos, size_t total)
+{
+	if (channels <= 2)
+		mix_fade_func(dst, src, len, channels, pos, total);
+	else
+		mix_fade_c(dst, src, len, channels, pos, total);
+}
+
+void reset_meter(struct level_meter *meter, unsigned int channels)
+{
+	memset(meter, 0, sizeof(*meter));
+	meter->channels = channels;
+}
+
+void measure_levels(struct level_meter *meter, const fsample_t *buf,
+		    size_t len)
+{
+	if (meter->channels == 0)
+		return;
+	size_t frames = len / meter->channels;
+	if (meter->channels <= 2)
+		measure_func(meter, buf, frames);
+	else
+		measure_c(meter, buf, frames);
+	meter->frames += frames;
+}
+
+/* Get the levels since the last call, scaled by the gain */
+void read_meter(struct level_meter *meter, struct audio_levels *levels,
+		float gain)
+{
+	int ch;
+	for (ch = 0; ch < 2; ++ch) {
+		levels->peak[ch] = meter->peak[ch] * gain;
+		levels->rms[ch] = 0;
+		if (meter->frames)
+			levels->rms[ch] = sqrt(meter->sum[ch] / meter->frames) * gain;
+	}
+	levels->correlation = 0;
+	if (meter->sum[0] > 0 && meter->sum[1] > 0)
+		levels->correlation = meter->cross /
+			sqrt(meter->sum[0] * meter->sum[1]);
+
+	reset_meter(meter, meter->channels);
+}
+
+/* Select the fastest implementations the CPU supports */
+void init_sample(void)
+{
+#ifdef HAVE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		info("using AVX2 sample conversion\n");
+		float_to_s16_func = float_to_s16_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		info("using SSE2 sample conversion\n");
+		float_to_s16_func = float_to_s16_sse2;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		measure_func = measure_sse2;
+		mix_fade_func = mix_fade_sse2;
+	}
+#endif
+}
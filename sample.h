@@ -0,0 +1,39 @@
+#ifndef _JAPLAY_SAMPLE_H_
+#define _JAPLAY_SAMPLE_H_
+
+#include <string.h> /* size_t */
+#include "plugin.h"
+
+/* Levels of the first two channels, full scale is 1.0 */
+struct audio_levels {
+	float peak[2], rms[2];
+	float correlation; /* -1.0 .. 1.0 */
+};
+
+/* Level meter, accumulates over several chunks of audio */
+struct level_meter {
+	unsigned int channels;
+	size_t frames;
+	double sum[2], cross;
+	float peak[2];
+};
+
+/* Sample format conversions */
+
+void s16_to_float(fsample_t *dst, const sample_t *src, size_t len);
+void float_to_s16(sample_t *dst, const fsample_t *src, size_t len,
+		  float gain);
+void scale_samples(fsample_t *buf, size_t len, float gain);
+
+void mix_fade(fsample_t *dst, const fsample_t *src, size_t len,
+	      unsigned int channels, size_t pos, size_t total);
+
+void reset_meter(struct level_meter *meter, unsigned int channels);
+void measure_levels(struct level_meter *meter, const fsample_t *buf,
+		    size_t len);
+void read_meter(struct level_meter *meter, struct audio_levels *levels,
+		float gain);
+
+void init_sample(void);
+
+#endif
@@ -8,6 +8,7 @@
 #define SCOPE_SIZE	256  /* enough for 50 KHz, stereo */
 
 struct song;
+struct audio_levels;
 struct entry_ui_ctx;
 struct playlist;
 struct playlist_ui_ctx;
@@ -23,7 +24,8 @@ void ui_init_playlist(struct playlist *playlist);
 void ui_hide_playlist(struct playlist *playlist);
 void ui_update_entry(struct playlist *playlist, struct playlist_entry *entry);
 void ui_set_cursor(struct playlist_entry *entry);
-void ui_set_status(int *scope, size_t scope_len, unsigned int position);
+void ui_set_status(int *scope, size_t scope_len, unsigned int position,
+		   const struct audio_levels *levels);
 void ui_set_streaming_title(const char *title);
 void ui_show_message(const char *fmt, ...);
 
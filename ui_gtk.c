@@ -9,6 +9,7 @@
 #include "utils.h"
 #include "unixsocket.h"
 #include "settings.h"
+#include "sample.h"
 
 #include <gtk/gtk.h>
 #include <gdk/gdkx.h>
@@ -55,6 +56,7 @@ static GThread *main_thread;
 static struct playlist_page *pages[64] = {NULL,};
 static struct playlist *main_playlist;
 static GdkPoint scope_points[SCOPE_WIDTH];
+static struct audio_levels scope_levels;
 
 static void lock_ui()
 {
@@ -255,7 +257,8 @@ void ui_set_cursor(struct playlist_entry *entry)
 	unlock_ui();
 }
 
-void ui_set_status(int *scope, size_t scope_len, unsigned int position)
+void ui_set_status(int *scope, size_t scope_len, unsigned int position,
+		   const struct audio_levels *levels)
 {
 	if (scope_len > SCOPE_SIZE)
 		scope_len = SCOPE_SIZE;
@@ -273,6 +276,7 @@ void ui_set_status(int *scope, size_t scope_len, unsigned int position)
 		scope_points[i].x = i;
 		scope_points[i].y = scope[i * scope_len / SCOPE_WIDTH] * h / 2 / SHRT_MAX + h / 2;
 	}
+	scope_levels = *levels;
 	gtk_widget_queue_draw_area(scope_area, 0, 0, w, h);
 
 	GtkAdjustment *adj = gtk_range_get_adjustment(GTK_RANGE(seekbar));
@@ -702,6 +706,26 @@ gboolean expose_event_cb(GtkWidget *widget, GdkEventExpose *event, gpointer ptr)
 			   true, 0, 0, w, h);
 	gdk_draw_lines(widget->window, widget->style->white_gc,
 		       scope_points, SCOPE_WIDTH);
+
+	/* level meters at the bottom, RMS as a bar and peak as a tick */
+	int ch;
+	for (ch = 0; ch < 2; ++ch) {
+		int y = h - (2 - ch) * 3;
+		int rms = MIN(scope_levels.rms[ch], 1) * w;
+		int peak = MIN(scope_levels.peak[ch], 1) * w;
+		gdk_draw_rectangle(widget->window, widget->style->white_gc,
+				   true, 0, y, rms, 2);
+		gdk_draw_rectangle(widget->window, widget->style->white_gc,
+				   true, peak > 0 ? peak - 1 : 0, y, 1, 2);
+	}
+
+	/* stereo correlation at the top, a bar from the middle to the right
+	   when the channels are in phase and to the left when out of phase */
+	int mid = w / 2;
+	int corr = scope_levels.correlation * mid;
+	gdk_draw_rectangle(widget->window, widget->style->white_gc, true,
+			   corr < 0 ? mid + corr : mid, 1,
+			   corr < 0 ? 1 - corr : corr + 1, 2);
 	return true;
 }
 
@@ -768,7 +792,7 @@ int main(int argc, char **argv)
 	g_signal_connect(G_OBJECT(item), "toggled", G_CALLBACK(enable_shuffle_cb), NULL);
 	gtk_menu_append(GTK_MENU(file_menu), item);
 
-	item = gtk_check_menu_item_new_with_label("Enable automatic volume");
+	item = gtk_check_menu_item_new_with_label("Normalize loudness");
 	g_signal_connect(G_OBJECT(item), "toggled", G_CALLBACK(enable_autovol_cb), NULL);
 	gtk_menu_append(GTK_MENU(file_menu), item);
 